@@ -26,6 +26,12 @@
 #define strchr_P strchr
 #endif
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #ifdef PG_USE_MD5
 static void
 bytesToHex(const uint8_t b[16], char *s)
@@ -94,6 +100,12 @@ static void pg_md5_encrypt(const char *password, char *salt, int salt_len, char
 #define AUTH_REQ_OK			0	/* User is authenticated  */
 #define AUTH_REQ_PASSWORD	3	/* Password */
 #define AUTH_REQ_MD5		5	/* md5 password */
+#define CANCEL_REQUEST_CODE 80877102 /* 1234 << 16 | 5678 */
+
+#define PG_PORTAL_NONE 0
+#define PG_PORTAL_IDLE 1    /* opened or suspended, may fetch */
+#define PG_PORTAL_FETCH 2   /* Execute sent */
+#define PG_PORTAL_DONE 3    /* completed or failed, must be closed */
 
 static PROGMEM const char EM_OOM [] = "Out of memory";
 static PROGMEM const char EM_READ [] = "Backend read error";
@@ -102,11 +114,257 @@ static PROGMEM const char EM_CONN [] = "Cannot connect to server";
 static PROGMEM const char EM_SYNC [] = "Backend out of sync";
 static PROGMEM const char EM_INTR [] = "Internal error";
 static PROGMEM const char EM_UAUTH [] = "Unsupported auth method";
-static PROGMEM const char EM_BIN [] = "Binary format not supported";
 static PROGMEM const char EM_EXEC [] = "Previous execution not finished";
 static PROGMEM const char EM_PASSWD [] = "Password required";
 static PROGMEM const char EM_EMPTY [] = "Query is empty";
 static PROGMEM const char EM_FORMAT [] = "Illegal formatting character";
+static PROGMEM const char EM_NOCOPY [] = "Not in COPY IN mode";
+static PROGMEM const char EM_NOPORTAL [] = "No portal ready";
+
+#if defined(__SANITIZE_ADDRESS__)
+#define PG_NO_ASAN __attribute__((no_sanitize_address))
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define PG_NO_ASAN __attribute__((no_sanitize_address))
+#endif
+#endif
+#ifndef PG_NO_ASAN
+#define PG_NO_ASAN
+#endif
+
+/*
+ * returns pointer to first backslash, quote character q
+ * or terminating zero in s.
+ * Wide loads are aligned, so they never cross page boundary,
+ * even if they read past end of string (not checked by ASan).
+ */
+PG_NO_ASAN
+static const char *pg_scan(const char *s, char q)
+{
+#if defined(__SSE2__)
+    unsigned mis = (uintptr_t)s & 15;
+    const __m128i *p = (const __m128i *)(s - mis);
+    const __m128i vq = _mm_set1_epi8(q);
+    const __m128i vb = _mm_set1_epi8('\\');
+    const __m128i vz = _mm_setzero_si128();
+    __m128i v = _mm_load_si128(p);
+    unsigned m = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(
+        _mm_cmpeq_epi8(v, vq), _mm_cmpeq_epi8(v, vb)), _mm_cmpeq_epi8(v, vz)));
+    m &= 0xffffu << mis;
+    while (!m) {
+        v = _mm_load_si128(++p);
+        m = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(
+            _mm_cmpeq_epi8(v, vq), _mm_cmpeq_epi8(v, vb)), _mm_cmpeq_epi8(v, vz)));
+    }
+    return (const char *)p + __builtin_ctz(m);
+#else
+#if defined(__aarch64__) && defined(__ARM_NEON)
+    const uint8_t *p = (const uint8_t *)((uintptr_t)s & ~(uintptr_t)15);
+    const uint8x16_t vq = vdupq_n_u8(q);
+    const uint8x16_t vb = vdupq_n_u8('\\');
+    uint8x16_t v;
+    // first block may start before s, it is checked byte by byte
+    for (; s < (const char *)p + 16; s++) {
+        if (!*s || *s == q || *s == '\\') return s;
+    }
+    for (p += 16;; p += 16) {
+        v = vld1q_u8(p);
+        v = vorrq_u8(vorrq_u8(vceqq_u8(v, vq), vceqq_u8(v, vb)), vceqzq_u8(v));
+        if (vmaxvq_u8(v)) break;
+    }
+    s = (const char *)p;
+#elif !defined(__AVR__)
+    // 32-bit SWAR: byte of v is zero if (v - 0x01) & ~v has high bit set
+    const uint32_t ones = 0x01010101UL, highs = 0x80808080UL;
+    const uint32_t wq = ones * (uint8_t)q, wb = ones * '\\';
+    uint32_t v;
+    for (; (uintptr_t)s & 3; s++) {
+        if (!*s || *s == q || *s == '\\') return s;
+    }
+    for (;; s += 4) {
+        memcpy(&v, s, 4);
+        if ((((v - ones) & ~v) | (((v ^ wq) - ones) & ~(v ^ wq)) |
+                (((v ^ wb) - ones) & ~(v ^ wb))) & highs) break;
+    }
+#endif
+    while (*s && *s != q && *s != '\\') s++;
+    return s;
+#endif
+}
+
+// seconds between 1970-01-01 and 2000-01-01
+#define PG_EPOCH_OFFSET 946684800LL
+
+static int64_t pg_atoll(const char *c)
+{
+    int64_t v = 0;
+    byte neg = 0;
+    while (*c == ' ') c++;
+    if (*c == '-') {
+        neg = 1;
+        c++;
+    }
+    else if (*c == '+') c++;
+    while (*c >= '0' && *c <= '9') v = v * 10 + (*c++ - '0');
+    return neg ? -v : v;
+}
+
+static const char *pg_getnum(const char *c, int ndig, int *v)
+{
+    *v = 0;
+    while (ndig-- > 0) {
+        if (*c < '0' || *c > '9') return NULL;
+        *v = *v * 10 + (*c++ - '0');
+    }
+    return c;
+}
+
+// days since 1970-01-01 in proleptic Gregorian calendar
+static int32_t pg_days(int y, int m, int d)
+{
+    int32_t era, yoe, doy;
+    if (m <= 2) y--;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    return era * 146097L + yoe * 365L + yoe / 4 - yoe / 100 + doy - 719468L;
+}
+
+/*
+ * parses timestamp in ISO format (YYYY-MM-DD HH:MM:SS[.ffffff][+HH[:MM]])
+ * into seconds since 1970-01-01 and microseconds
+ * returns zero on success or -1 on error
+ */
+static int pg_parse_timestamp(const char *c, int64_t *secs, int32_t *micros)
+{
+    int y, mon, d, h = 0, min = 0, sec = 0, tzh = 0, tzm = 0;
+    int32_t usec = 0, mul = 100000;
+    char sign;
+    if (!(c = pg_getnum(c, 4, &y)) || *c++ != '-' ||
+            !(c = pg_getnum(c, 2, &mon)) || *c++ != '-' ||
+            !(c = pg_getnum(c, 2, &d))) return -1;
+    if (*c == ' ' || *c == 'T') {
+        c++;
+        if (!(c = pg_getnum(c, 2, &h)) || *c++ != ':' ||
+                !(c = pg_getnum(c, 2, &min)) || *c++ != ':' ||
+                !(c = pg_getnum(c, 2, &sec))) return -1;
+        if (*c == '.') {
+            for (c++; *c >= '0' && *c <= '9'; c++) {
+                usec += (*c - '0') * mul;
+                mul /= 10;
+            }
+        }
+        if (*c == '+' || *c == '-') {
+            sign = *c++;
+            if (!(c = pg_getnum(c, 2, &tzh))) return -1;
+            if (*c == ':') c++;
+            if (*c >= '0' && *c <= '9' && !(c = pg_getnum(c, 2, &tzm))) return -1;
+            if (sign == '-') {
+                tzh = -tzh;
+                tzm = -tzm;
+            }
+        }
+    }
+    *secs = (int64_t)pg_days(y, mon, d) * 86400L +
+        (int32_t)(h - tzh) * 3600L + (int32_t)(min - tzm) * 60L + sec;
+    *micros = usec;
+    return 0;
+}
+
+/*
+ * parses integer of len characters, without leading spaces
+ * returns zero on success or -1 on syntax error or overflow
+ */
+static int pg_parse_int(const char *c, int len, int64_t *result)
+{
+    const char *e = c + len, *m;
+    uint64_t u;
+    uint32_t w = 0;
+    byte neg = 0;
+    if (c < e && (*c == '-' || *c == '+')) neg = *c++ == '-';
+    if (c == e || e - c > 19) return -1;
+    // 32-bit arithmetic is much cheaper on MCU, use it for first 9 digits
+    for (m = e - c > 9 ? c + 9 : e; c < m; c++) {
+        if ((byte)(*c - '0') > 9) return -1;
+        w = w * 10 + (*c - '0');
+    }
+    for (u = w; c < e; c++) {
+        if ((byte)(*c - '0') > 9) return -1;
+        u = u * 10 + (*c - '0');
+    }
+    if (u > (uint64_t)INT64_MAX + neg) return -1;
+    *result = neg ? (int64_t)(0 - u) : (int64_t)u;
+    return 0;
+}
+
+static const double pg_pow10[] = {1e1, 1e2, 1e4, 1e8, 1e16, 1e32
+#if __SIZEOF_DOUBLE__ == 8
+    , 1e64, 1e128, 1e256
+#endif
+};
+
+/*
+ * parses floating point number of len characters
+ * as sent by backend for float and numeric types
+ * digits beyond 19th are dropped, result may differ
+ * from strtod in last bit
+ * returns zero on success or -1 on syntax error
+ */
+static int pg_parse_float(const char *c, int len, double *result)
+{
+    const char *e = c + len;
+    uint64_t m = 0;
+    double p = 1, r;
+    int exp = 0, x = 0, nd = 0, i;
+    byte neg = 0, xneg = 0, digits = 0;
+    if (c < e && (*c == '-' || *c == '+')) neg = *c++ == '-';
+    if (e - c == 3 && !memcmp(c, "NaN", 3)) {
+        *result = NAN;
+        return 0;
+    }
+    if (e - c == 8 && !memcmp(c, "Infinity", 8)) {
+        *result = neg ? -INFINITY : INFINITY;
+        return 0;
+    }
+    for (; c < e && (byte)(*c - '0') <= 9; c++, digits = 1) {
+        if (nd < 19) {
+            m = m * 10 + (*c - '0');
+            if (m) nd++;
+        }
+        else exp++;
+    }
+    if (c < e && *c == '.') {
+        for (c++; c < e && (byte)(*c - '0') <= 9; c++, digits = 1) {
+            if (nd < 19) {
+                m = m * 10 + (*c - '0');
+                if (m) nd++;
+                exp--;
+            }
+        }
+    }
+    if (!digits) return -1;
+    if (c < e && (*c == 'e' || *c == 'E')) {
+        c++;
+        if (c < e && (*c == '-' || *c == '+')) xneg = *c++ == '-';
+        if (c == e) return -1;
+        for (; c < e && (byte)(*c - '0') <= 9; c++) {
+            if (x < 10000) x = x * 10 + (*c - '0');
+        }
+        exp += xneg ? -x : x;
+    }
+    if (c != e) return -1;
+    r = m;
+    // keep divisor finite for values near smallest double
+    for (; exp < -300 && r; exp += 32) r /= 1e32;
+    x = exp < 0 ? -exp : exp;
+    for (i = 0; x && i < (int)(sizeof(pg_pow10) / sizeof(pg_pow10[0])); i++, x >>= 1) {
+        if (x & 1) p *= pg_pow10[i];
+    }
+    if (x) r = (exp < 0 || !m) ? 0 : INFINITY;
+    else r = exp < 0 ? r / p : r * p;
+    *result = neg ? -r : r;
+    return 0;
+}
 
 PGconnection::PGconnection(Client *c,
         int flags,
@@ -116,16 +374,62 @@ PGconnection::PGconnection(Client *c,
     conn_status = CONNECTION_NEEDED;
     client = c;
     Buffer = foreignBuffer;
-    _passwd = NULL;
+    _user = _passwd = NULL;
+    _profile = NULL;
+    rxPos = rxLen = 0;
+    txLen = 0;
+    _msgType = 0;
+    result_status = 0;
+    _nfields = 0;
+    _formats = 0;
+    _binary = 0;
+    pqFreeTables();
+    _result = NULL;
+    _portal = PG_PORTAL_NONE;
+    _qSent = _qDone = _qIndex = 0;
+    copyHandler = NULL;
+    rowHandler = NULL;
+#if PG_ROW_QUEUE
+    rowQueue = NULL;
+#endif
+    chunkHandler = NULL;
     _flags = flags & ~PG_FLAG_STATIC_BUFFER;
 
     if (memory <= 0) bufSize = PG_BUFFER_SIZE;
     else bufSize = memory;
+#if !PG_WIDE_FIELDS
+    // positions in field table are 16-bit
+    if (bufSize > 32767) bufSize = 32767;
+#endif
     if (foreignBuffer) {
         _flags |= PG_FLAG_STATIC_BUFFER;
     }
 }
 
+int PGconnection::setDbLogin(const PGprofile *profile)
+{
+    close();
+    if (!profile->packet) {
+        setMsg_P(EM_CONN, PG_RSTAT_HAVE_ERROR);
+        return conn_status = CONNECTION_BAD;
+    }
+    if (!Buffer) Buffer = (char *) malloc(bufSize);
+    _profile = profile;
+    _server = profile->server;
+    _port = profile->port;
+    be_pid = be_key = 0;
+    if (!client->connect(_server, _port)) {
+        setMsg_P(EM_CONN, PG_RSTAT_HAVE_ERROR);
+        return conn_status = CONNECTION_BAD;
+    }
+    if (pqPacketSend(0, profile->packet, profile->packetLen) < 0) {
+        setMsg_P(EM_WRITE, PG_RSTAT_HAVE_ERROR);
+        return conn_status = CONNECTION_BAD;
+    }
+    attempts = 0;
+    return conn_status = CONNECTION_AWAITING_RESPONSE;
+}
+
 int PGconnection::setDbLogin(IPAddress server,
     const char *user,
     const char *passwd,
@@ -154,6 +458,9 @@ int PGconnection::setDbLogin(IPAddress server,
         _passwd = NULL;
     }
     if (!Buffer) Buffer = (char *) malloc(bufSize);
+    _server = server;
+    _port = port;
+    be_pid = be_key = 0;
     byte connected = client -> connect(server, port);
     if (!connected) {
         setMsg_P(EM_CONN, PG_RSTAT_HAVE_ERROR);
@@ -178,9 +485,10 @@ int PGconnection::setDbLogin(IPAddress server,
 void PGconnection::close(void)
 {
     if (client->connected()) {
-        pqPacketSend('X', NULL, 0);
+        if (!pqPacketSend('X', NULL, 0)) pqFlush();
         client->stop();
     }
+    txLen = 0;
     if (Buffer && !(_flags & PG_FLAG_STATIC_BUFFER)) {
         free(Buffer);
         Buffer = NULL;
@@ -189,20 +497,48 @@ void PGconnection::close(void)
         free(_user);
         _user = _passwd = NULL;
     }
+    _profile = NULL;
+    rxPos = rxLen = 0;
+    _msgType = 0;
+    _binary = 0;
+    pqFreeTables();
+    _result = NULL;
+    _portal = PG_PORTAL_NONE;
+    _qSent = _qDone = _qIndex = 0;
     conn_status = CONNECTION_NEEDED;
 }
 
+/*
+ * CancelRequest has no message type and is the only message
+ * sent on its connection; backend closes it without reply
+ */
+int PGconnection::cancel(Client *c)
+{
+    byte pkt[16];
+    int32_t v[4];
+    int i;
+    if (conn_status != CONNECTION_OK || (!be_pid && !be_key)) return -1;
+    v[0] = 16;
+    v[1] = CANCEL_REQUEST_CODE;
+    v[2] = be_pid;
+    v[3] = be_key;
+    for (i = 0; i < 16; i++) pkt[i] = v[i / 4] >> (24 - 8 * (i & 3));
+    if (!c->connect(_server, _port)) return -2;
+    i = c->write(pkt, 16);
+    c->stop();
+    return i == 16 ? 0 : -3;
+}
+
 int PGconnection::status(void)
 {
-    char bereq;
     char rc;
-    int32_t msgLen;
     int32_t areq;
     char * pwd = _passwd;
 #ifdef PG_USE_MD5
     char salt[4];
 #endif
 
+    if (txLen && flush()) return conn_status;
     switch(conn_status) {
         case CONNECTION_NEEDED:
         case CONNECTION_OK:
@@ -211,34 +547,41 @@ int PGconnection::status(void)
         return conn_status;
 
         case CONNECTION_AWAITING_RESPONSE:
-        if (!client->available()) return conn_status;
-        if (attempts++ >= 2) {
-            setMsg_P(EM_SYNC, PG_RSTAT_HAVE_ERROR);
-            return conn_status = CONNECTION_BAD;
-        }
-        if (pqGetc(&bereq)) {
-            goto read_error;
+        if (!_msgType) {
+            if (!pqAvailable()) return conn_status;
+            rc = pqGetHeader();
+            if (rc < 0) goto read_error;
+            if (!rc) return conn_status;
+            if (_msgType == 'R' && attempts++ >= 2) {
+                setMsg_P(EM_SYNC, PG_RSTAT_HAVE_ERROR);
+                return conn_status = CONNECTION_BAD;
+            }
         }
-        if (bereq == 'E') {
-            pqGetInt4(&msgLen);
-            pqGetNotice(PG_RSTAT_HAVE_ERROR);
+        if (_msgType == 'E') {
+            rc = pqGetNotice(PG_RSTAT_HAVE_ERROR);
+            if (!rc) return conn_status;
+            if (rc < 0) goto read_error;
             return conn_status = CONNECTION_BAD;
         }
-        if (bereq != 'R') {
+        if (_msgType != 'R') {
             setMsg_P(EM_SYNC, PG_RSTAT_HAVE_ERROR);
             return conn_status = CONNECTION_BAD;
         }
-        if (pqGetInt4(&msgLen)) {
-            goto read_error;
-        }
+        // authentication request and md5 salt are read at once
+        rc = pqNeed(_msgLen < 8 ? 4 : 8);
+        if (rc < 0) goto read_error;
+        if (!rc) return conn_status;
         if (pqGetInt4(&areq)) {
             goto read_error;
         }
         if (areq == AUTH_REQ_OK) {
+            if (_msgLen) goto sync_error;
+            _msgType = 0;
             if (_user) {
                 free(_user);
                 _user = _passwd=NULL;
             }
+            _profile = NULL;
             result_status = PG_RSTAT_READY;
             return conn_status = CONNECTION_AUTH_OK;
         }
@@ -250,25 +593,35 @@ int PGconnection::status(void)
             setMsg_P(EM_UAUTH, PG_RSTAT_HAVE_ERROR);
             return conn_status = CONNECTION_BAD;
         }
-        if (!_passwd || !*_passwd) {
+        pwd = _profile ? _profile->secret : _passwd;
+        if (!pwd || !*pwd) {
             setMsg_P(EM_PASSWD, PG_RSTAT_HAVE_ERROR);
             return conn_status = CONNECTION_BAD;
         }
-        pwd = _passwd;
 #ifdef PG_USE_MD5
+        // profile keeps only hashed password
+        if (_profile && areq != AUTH_REQ_MD5) {
+            setMsg_P(EM_UAUTH, PG_RSTAT_HAVE_ERROR);
+            return conn_status = CONNECTION_BAD;
+        }
         if (areq == AUTH_REQ_MD5) {
-            if (pqGetnchar(salt, 4)) goto read_error;
+            if (pqGetnchar(salt, 4) != 4) goto sync_error;
             if (bufSize < 3 * MD5_PASSWD_LEN + 10) {
                 setMsg_P(EM_OOM, PG_RSTAT_HAVE_ERROR);
                 return conn_status = CONNECTION_BAD;
             }
             char *crypt_pwd = Buffer + (bufSize - (2 * (MD5_PASSWD_LEN + 1)));
             char *crypt_pwd2 = crypt_pwd + MD5_PASSWD_LEN + 1;
-            pg_md5_encrypt(pwd, _user, strlen(_user), crypt_pwd2);
-            pg_md5_encrypt(crypt_pwd2 + 3, salt,4, crypt_pwd);
+            if (!_profile) {
+                pg_md5_encrypt(pwd, _user, strlen(_user), crypt_pwd2);
+                pwd = crypt_pwd2;
+            }
+            pg_md5_encrypt(pwd + 3, salt,4, crypt_pwd);
             pwd = crypt_pwd;
         }
 #endif
+        if (_msgLen) goto sync_error;
+        _msgType = 0;
         rc=pqPacketSend('p', pwd, strlen(pwd) + 1);
         if (rc) {
             goto write_error;
@@ -277,27 +630,38 @@ int PGconnection::status(void)
 
         case CONNECTION_AUTH_OK:
         for (;;) {
-            if (!client -> available()) return conn_status;
-            if (pqGetc(&bereq)) goto read_error;
-            if (pqGetInt4(&msgLen)) goto read_error;
-            msgLen -= 4;
-            if (bereq == 'A' || bereq == 'N' || bereq == 'S' || bereq == 'K') {
-                if (pqSkipnchar(msgLen))  goto read_error;
+            if (!_msgType) {
+                if (!pqAvailable()) return conn_status;
+                rc = pqGetHeader();
+                if (rc < 0) goto read_error;
+                if (!rc) return conn_status;
+            }
+            if (_msgType == 'K') {
+                if ((rc = pqNeed(8)) < 0) goto read_error;
+                if (!rc) return conn_status;
+                if (pqGetInt4(&be_pid) || pqGetInt4(&be_key)) goto read_error;
+                if (pqSkipnchar(_msgLen) < 0) goto read_error;
+                if (_msgLen) return conn_status;
+                _msgType = 0;
+                continue;
+            }
+            if (_msgType == 'A' || _msgType == 'N' || _msgType == 'S') {
+                if (pqSkipnchar(_msgLen) < 0)  goto read_error;
+                if (_msgLen) return conn_status;
+                _msgType = 0;
                 continue;
             }
-            if (bereq == 'E') {
-                pqGetNotice(PG_RSTAT_HAVE_ERROR);
+            if (_msgType == 'E') {
+                rc = pqGetNotice(PG_RSTAT_HAVE_ERROR);
+                if (!rc) return conn_status;
+                if (rc < 0) goto read_error;
                 return conn_status = CONNECTION_BAD;
             }
 
-/*            if (bereq == 'K') {
-                if (pqGetInt4(&be_pid)) goto read_error;
-                if (pqGetInt4(&be_key)) goto read_error;
-                continue;
-            }
-*/
-            if (bereq == 'Z') {
-                pqSkipnchar(msgLen);
+            if (_msgType == 'Z') {
+                if (pqSkipnchar(_msgLen) < 0) goto read_error;
+                if (_msgLen) return conn_status;
+                _msgType = 0;
                 return conn_status = CONNECTION_OK;
             }
             return conn_status = CONNECTION_BAD;
@@ -307,6 +671,9 @@ int PGconnection::status(void)
         setMsg_P(EM_INTR, PG_RSTAT_HAVE_ERROR);
         return conn_status = CONNECTION_BAD;
     }
+sync_error:
+    setMsg_P(EM_SYNC, PG_RSTAT_HAVE_ERROR);
+    return conn_status = CONNECTION_BAD;
 read_error:
     setMsg_P(EM_READ, PG_RSTAT_HAVE_ERROR);
     return conn_status = CONNECTION_BAD;
@@ -315,12 +682,46 @@ write_error:
     return conn_status = CONNECTION_BAD;
 }
 
+/*
+ * checks if next query may be sent
+ * partially received message (e.g. asynchronous notification)
+ * doesn't prevent it, as queries are not assembled in internal
+ * buffer then (see formatBegin)
+ */
+int PGconnection::pqCanSend(void)
+{
+    if (pqSendable()) return 0;
+    setMsg_P(EM_EXEC, PG_RSTAT_HAVE_ERROR);
+    return -1;
+}
+
+/*
+ * as above, without setting message
+ * returns non-zero if query may be sent
+ */
+int PGconnection::pqSendable(void)
+{
+    if (result_status & PG_RSTAT_READY) return 1;
+    return (_flags & PG_FLAG_PIPELINE) &&
+            !(result_status & (PG_RSTAT_COPY_IN | PG_RSTAT_COPY_OUT)) &&
+            (uint16_t)(_qSent - _qDone) < PG_PIPELINE_DEPTH;
+}
+
+void PGconnection::pqQuerySent(int binary)
+{
+    uint32_t bit = (uint32_t)1 << (_qSent & 31);
+    if (binary) _binary |= bit;
+    else _binary &= ~bit;
+    _qSent++;
+    // in pipeline mode current row or columns remain available
+    result_status = (result_status & (PG_RSTAT_HAVE_COLUMNS | PG_RSTAT_HAVE_ROW)) |
+        PG_RSTAT_COMMAND_SENT;
+}
+
 int PGconnection::execute(const char *query, int progmem)
 {
-    if (!(result_status & PG_RSTAT_READY)) {
-        setMsg_P(EM_EXEC, PG_RSTAT_HAVE_ERROR);
-        return -1;
-    }
+    int rc;
+    if ((rc = pqCanSend()) != 0) return rc;
     int len =
 #ifndef ESP32
      progmem ? strlen_P(query) :
@@ -331,144 +732,895 @@ int PGconnection::execute(const char *query, int progmem)
         conn_status = CONNECTION_BAD;
         return -1;
     }
-    result_status = PG_RSTAT_COMMAND_SENT;
+    pqQuerySent();
     return 0;
 }
-int PGconnection::escapeName(const char *inbuf, char *outbuf)
+int PGconnection::prepare(const char *name, const char *query, int progmem)
 {
-    const char *c;
-    int l = 2;
-    for (c=inbuf; *c; c++) {
-        l++;
-        if (*c == '\\' || *c == '"') l++;
+    int nlen, qlen, rc;
+    if ((rc = pqCanSend()) != 0) return rc;
+    if (!name) name = "";
+    nlen = strlen(name) + 1;
+    qlen =
+#ifndef ESP32
+     progmem ? strlen_P(query) :
+#endif
+        strlen(query);
+    qlen++;
+    rc = writeMsgHeader('P', nlen + qlen + 2);
+    if (!rc) rc = writeMsgPart(name, nlen, false);
+    if (!rc) {
+#ifndef ESP32
+        if (progmem) rc = writeMsgPart_P(query, qlen, false);
+        else
+#endif
+        rc = writeMsgPart(query, qlen, false);
     }
-    if (outbuf) {
-        *outbuf++='"';
-        for (c=inbuf; *c; c++) {
-            *outbuf++ = *c;
-            if (*c == '\\' || *c == '"') *outbuf++ = *c;
-        }
-        *outbuf++='"';
+    if (!rc) rc = writeMsgInt(0, 2); // parameter types inferred by backend
+    if (!rc) rc = writeMsgHeader('S', 0);
+    if (!rc) rc = writeMsgPart(NULL, 0, true);
+    if (rc) {
+        setMsg_P(EM_WRITE, PG_RSTAT_HAVE_ERROR);
+        conn_status = CONNECTION_BAD;
+        return -1;
     }
-    return l;
+    pqQuerySent();
+    return 0;
 }
 
-int PGconnection::escapeString(const char *inbuf, char *outbuf)
+int PGconnection::executePrepared(const char *name, int nparams, const char * const *values, int binary)
 {
-    const char *c;
-    int e = 0, l;
-    for (c=inbuf; *c; c++) {
-        if (*c == '\\' || *c == '\'') e++;
+    int32_t blen;
+    int nlen, i, rc;
+    if ((rc = pqCanSend()) != 0) return rc;
+    if (!name) name = "";
+    nlen = strlen(name) + 1;
+    blen = 1 + nlen + 2 + 2 + (binary ? 4 : 2);
+    for (i = 0; i < nparams; i++) {
+        blen += 4;
+        if (values[i]) blen += strlen(values[i]);
     }
-    l = e + (c - inbuf) + (e ? 4 : 2);
-    if (outbuf) {
-        if (e) {
-            *outbuf++=' ';
-            *outbuf++='E';
-        }
-        *outbuf++='\'';
-        for (c=inbuf; *c; c++) {
-            *outbuf++ = *c;
-            if (*c == '\\' || *c == '\'') *outbuf++ = *c;
+    // Bind unnamed portal, parameters in text format
+    rc = writeMsgHeader('B', blen);
+    if (!rc) rc = writeMsgPart("", 1, false);
+    if (!rc) rc = writeMsgPart(name, nlen, false);
+    if (!rc) rc = writeMsgInt(0, 2);
+    if (!rc) rc = writeMsgInt(nparams, 2);
+    for (i = 0; !rc && i < nparams; i++) {
+        if (!values[i]) {
+            rc = writeMsgInt(-1, 4);
+            continue;
         }
-        *outbuf++='\'';
+        blen = strlen(values[i]);
+        rc = writeMsgInt(blen, 4);
+        if (!rc) rc = writeMsgPart(values[i], blen, false);
+    }
+    // single result format code applies to all columns
+    if (!rc) rc = writeMsgInt(binary ? 1 : 0, 2);
+    if (!rc && binary) rc = writeMsgInt(1, 2);
+    // Describe portal, so we receive RowDescription
+    if (!rc) rc = writeMsgHeader('D', 2);
+    if (!rc) rc = writeMsgPart("P", 2, false);
+    // Execute portal, no row limit
+    if (!rc) rc = writeMsgHeader('E', 5);
+    if (!rc) rc = writeMsgPart("", 1, false);
+    if (!rc) rc = writeMsgInt(0, 4);
+    if (!rc) rc = writeMsgHeader('S', 0);
+    if (!rc) rc = writeMsgPart(NULL, 0, true);
+    if (rc) {
+        setMsg_P(EM_WRITE, PG_RSTAT_HAVE_ERROR);
+        conn_status = CONNECTION_BAD;
+        return -1;
     }
-    return l;
+    pqQuerySent(binary);
+    return 0;
 }
 
-char * PGconnection::getValue(int nr)
+/*
+ * portal messages end with Flush instead of Sync, so implicit
+ * transaction (and unnamed portal) lasts until closePortal()
+ */
+int PGconnection::openPortal(const char *query, int progmem)
 {
-    int i;
-    if (_null & (1<<nr)) return NULL;
-    char *c=Buffer;
-    if (nr < 0 || nr >= _nfields) return NULL;
-    for (i=0; i < nr; i++) {
-        if (_null & (1 <<i)) continue;
-        c += strlen(c) + 1;
+    int qlen, rc;
+    if (_msgType || !(result_status & PG_RSTAT_READY) || _portal) {
+        setMsg_P(EM_EXEC, PG_RSTAT_HAVE_ERROR);
+        return -1;
     }
-    return c;
+    qlen =
+#ifndef ESP32
+     progmem ? strlen_P(query) :
+#endif
+        strlen(query);
+    qlen++;
+    // Parse unnamed statement
+    rc = writeMsgHeader('P', 1 + qlen + 2);
+    if (!rc) rc = writeMsgPart("", 1, false);
+    if (!rc) {
+#ifndef ESP32
+        if (progmem) rc = writeMsgPart_P(query, qlen, false);
+        else
+#endif
+        rc = writeMsgPart(query, qlen, false);
+    }
+    if (!rc) rc = writeMsgInt(0, 2);
+    // Bind unnamed portal, no parameters, text results
+    if (!rc) rc = writeMsgHeader('B', 1 + 1 + 2 + 2 + 2);
+    if (!rc) rc = writeMsgPart("\0", 2, false);
+    if (!rc) rc = writeMsgInt(0, 2);
+    if (!rc) rc = writeMsgInt(0, 2);
+    if (!rc) rc = writeMsgInt(0, 2);
+    if (!rc) rc = writeMsgHeader('D', 2);
+    if (!rc) rc = writeMsgPart("P", 2, false);
+    if (!rc) rc = writeMsgHeader('H', 0);
+    if (!rc) rc = writeMsgPart(NULL, 0, true);
+    if (rc) {
+        setMsg_P(EM_WRITE, PG_RSTAT_HAVE_ERROR);
+        conn_status = CONNECTION_BAD;
+        return -1;
+    }
+    _portal = PG_PORTAL_IDLE;
+    result_status = PG_RSTAT_COMMAND_SENT;
+    return 0;
 }
 
-char *PGconnection::getColumn(int n)
+int PGconnection::fetch(int rows)
 {
-    char *c;int i;
-    if (!(result_status & PG_RSTAT_HAVE_COLUMNS)) return NULL;
-    if (n < 0 || n >= _nfields) return NULL;
-    for (c = Buffer, i = 0; i<n; i++) {
-        c += strlen(c) + 1;
+    int rc;
+    if (_portal != PG_PORTAL_IDLE) {
+        setMsg_P(EM_NOPORTAL, PG_RSTAT_HAVE_ERROR);
+        return -1;
     }
-    return c;
+    rc = writeMsgHeader('E', 5);
+    if (!rc) rc = writeMsgPart("", 1, false);
+    if (!rc) rc = writeMsgInt(rows > 0 ? rows : 0, 4);
+    if (!rc) rc = writeMsgHeader('H', 0);
+    if (!rc) rc = writeMsgPart(NULL, 0, true);
+    if (rc) {
+        setMsg_P(EM_WRITE, PG_RSTAT_HAVE_ERROR);
+        conn_status = CONNECTION_BAD;
+        return -1;
+    }
+    _portal = PG_PORTAL_FETCH;
+    result_status &= ~PG_RSTAT_HAVE_MASK;
+    return 0;
 }
 
-char *PGconnection::getMessage(void)
+int PGconnection::closePortal(void)
 {
-    if (!(result_status & PG_RSTAT_HAVE_MESSAGE)) return NULL;
-    return Buffer;
+    if (!_portal || _msgType) {
+        setMsg_P(_portal ? EM_EXEC : EM_NOPORTAL, PG_RSTAT_HAVE_ERROR);
+        return -1;
+    }
+    if (writeMsgHeader('S', 0) || writeMsgPart(NULL, 0, true)) {
+        setMsg_P(EM_WRITE, PG_RSTAT_HAVE_ERROR);
+        conn_status = CONNECTION_BAD;
+        return -1;
+    }
+    // ReadyForQuery ends it as any other query
+    _portal = PG_PORTAL_NONE;
+    pqQuerySent();
+    return 0;
 }
 
-int PGconnection::getData(void)
+/*
+ * sends CopyData message collected in Buffer
+ */
+int PGconnection::copyFlush(void)
 {
-    char id;
-    int32_t msgLen;
-    int rc;
-    char *c;
-    if (!client->available()) return 0;
-    if (pqGetc(&id)) goto read_error;
-    if (pqGetInt4(&msgLen)) goto read_error;
-    //Serial.printf("ID=%c\n", id);
-    msgLen -= 4;
-    switch(id) {
-        case 'T':
-        if ((rc=pqGetRowDescriptions())) {
-            if (rc == -2) setMsg_P(EM_OOM, PG_RSTAT_HAVE_ERROR);
-            else if (rc == -3) setMsg_P(EM_BIN, PG_RSTAT_HAVE_ERROR);
-            goto read_error;
-        }
-        if (_flags & PG_FLAG_IGNORE_COLUMNS) {
-            result_status &= ~PG_RSTAT_HAVE_MASK;
-            return 0;
-        }
-        return result_status = (result_status & ~PG_RSTAT_HAVE_MASK) | PG_RSTAT_HAVE_COLUMNS;
+    int32_t len = bufPos - 1;
+    if (bufPos <= 5) return 0;
+    Buffer[0] = 'd';
+    Buffer[1] = (len >> 24) & 0xff;
+    Buffer[2] = (len >> 16) & 0xff;
+    Buffer[3] = (len >> 8) & 0xff;
+    Buffer[4] = len & 0xff;
+    if (pqSend(Buffer, bufPos) || pqMsgEnd()) return -1;
+    bufPos = 5;
+    return 0;
+}
 
-        case 'E':
-        if (pqGetNotice(PG_RSTAT_HAVE_ERROR)) goto read_error;
-        return result_status;
+int PGconnection::copyPutData(const char *buf, int len)
+{
+    int n;
+    if (!(result_status & PG_RSTAT_COPY_IN)) {
+        setMsg_P(EM_NOCOPY, PG_RSTAT_HAVE_ERROR);
+        return -1;
+    }
+    while (len > 0) {
+        n = bufSize - bufPos;
+        if (n > len) n = len;
+        memcpy(Buffer + bufPos, buf, n);
+        bufPos += n;
+        buf += n;
+        len -= n;
+        if (bufPos >= bufSize && copyFlush()) goto write_error;
+    }
+    return 0;
+write_error:
+    result_status &= ~PG_RSTAT_COPY_IN;
+    setMsg_P(EM_WRITE, PG_RSTAT_HAVE_ERROR);
+    conn_status = CONNECTION_BAD;
+    return -1;
+}
 
-        case 'N':
-        if (_flags & PG_FLAG_IGNORE_NOTICES) {
-            if (pqSkipnchar(msgLen)) goto read_error;
-            return 0;
+int PGconnection::copyPutRow(int nfields, const char * const *values)
+{
+    const char *c, *run;
+    char esc[2];
+    int i, rc = 0;
+    for (i = 0; !rc && i < nfields; i++) {
+        if (i) rc = copyPutData("\t", 1);
+        if (!rc && !values[i]) {
+            rc = copyPutData("\\N", 2);
+            continue;
         }
-        if(pqGetNotice(PG_RSTAT_HAVE_NOTICE)) goto read_error;
-        return result_status = (result_status & ~PG_RSTAT_HAVE_MASK) | PG_RSTAT_HAVE_NOTICE;
-
-        case 'A':
-        if (_flags & PG_FLAG_IGNORE_NOTICES) {
-            if (pqSkipnchar(msgLen)) goto read_error;
-            return 0;
+        // copy runs of characters without escaping at once
+        for (run = c = values[i]; !rc && *c; c++) {
+            switch (*c) {
+                case '\\': esc[1] = '\\'; break;
+                case '\t': esc[1] = 't'; break;
+                case '\n': esc[1] = 'n'; break;
+                case '\r': esc[1] = 'r'; break;
+                default: continue;
+            }
+            esc[0] = '\\';
+            if (c > run) rc = copyPutData(run, c - run);
+            if (!rc) rc = copyPutData(esc, 2);
+            run = c + 1;
         }
-        if (pqGetNotify(msgLen)) goto read_error;
-        return result_status = (result_status & ~PG_RSTAT_HAVE_MASK) | PG_RSTAT_HAVE_NOTICE;
-
-        case 'Z':
-        if (pqSkipnchar(msgLen)) goto read_error;
-        result_status = (result_status & PG_RSTAT_HAVE_SUMMARY) | PG_RSTAT_READY;
-        return PG_RSTAT_READY;
-
-        case 'S': // parameters setting ignored
-        case 'K': // should not be here?
-        if (pqSkipnchar(msgLen)) goto read_error;
-        return 0;
+        if (!rc && c > run) rc = copyPutData(run, c - run);
+    }
+    if (!rc) rc = copyPutData("\n", 1);
+    return rc;
+}
 
-        case 'C': // summary
-        if (msgLen > bufSize - 1) goto oom;
-        if (pqGetnchar(Buffer, msgLen)) goto read_error;
-        Buffer[msgLen] = 0;
-        _ntuples = 0;
-        result_status = (result_status & ~PG_RSTAT_HAVE_MASK) | PG_RSTAT_HAVE_SUMMARY;
+int PGconnection::copyEnd(const char *errmsg)
+{
+    int rc, len;
+    if (!(result_status & PG_RSTAT_COPY_IN)) {
+        setMsg_P(EM_NOCOPY, PG_RSTAT_HAVE_ERROR);
+        return -1;
+    }
+    result_status &= ~PG_RSTAT_COPY_IN;
+    rc = copyFlush();
+    if (!rc) {
+        if (errmsg) {
+            len = strlen(errmsg) + 1;
+            rc = pqPacketSend('f', errmsg, len);
+        }
+        else {
+            rc = pqPacketSend('c', NULL, 0);
+        }
+    }
+    if (rc) {
+        setMsg_P(EM_WRITE, PG_RSTAT_HAVE_ERROR);
+        conn_status = CONNECTION_BAD;
+        return -1;
+    }
+    result_status = PG_RSTAT_COMMAND_SENT;
+    return 0;
+}
+
+/*
+ * collects CopyData bytes in Buffer and passes
+ * complete rows to copy handler
+ * row may be split between messages
+ */
+int PGconnection::pqGetCopyData(void)
+{
+    int n, i;
+    const char *c;
+    while (_msgLen > 0) {
+        if ((n = pqFill()) <= 0) return n;
+        if (n > _msgLen) n = _msgLen;
+        if (copyMode != PG_COPY_CSV) {
+            c = (const char *)memchr(rxBuf + rxPos, '\n', n);
+            if (c) n = c - (rxBuf + rxPos) + 1;
+        }
+        else {
+            // newline inside quoted CSV field doesn't end row
+            c = NULL;
+            for (i = 0; i < n; i++) {
+                if (rxBuf[rxPos + i] == '"') copyQuote = !copyQuote;
+                else if (rxBuf[rxPos + i] == '\n' && !copyQuote) {
+                    c = rxBuf + rxPos + i;
+                    n = i + 1;
+                    break;
+                }
+            }
+        }
+        if (copyPos + n > bufSize - 1) return -2;
+        memcpy(Buffer + copyPos, rxBuf + rxPos, n);
+        copyPos += n;
+        rxPos += n;
+        _msgLen -= n;
+        if (c) {
+            Buffer[--copyPos] = 0;
+            if (copyHandler) copyRow(Buffer, copyPos);
+            copyPos = 0;
+        }
+    }
+    return 1;
+}
+
+void PGconnection::copyRow(char *row, int len)
+{
+    char *in, *out, *start;
+    int field, quoted;
+    if (copyMode == PG_COPY_LINES) {
+        copyHandler(copyCtx, -1, row, len);
+        return;
+    }
+    in = row;
+    for (field = 0;; field++) {
+        // values are decoded in place, output never outruns input
+        start = out = in;
+        quoted = 0;
+        if (copyMode == PG_COPY_CSV) {
+            // quoted = 1 inside quotes, 2 after closing quote
+            for (; *in; in++) {
+                if (quoted == 1) {
+                    if (*in != '"') *out++ = *in;
+                    else if (in[1] == '"') *out++ = *++in;
+                    else quoted = 2;
+                }
+                else if (*in == ',') break;
+                else if (*in == '"') quoted = 1;
+                else *out++ = *in;
+            }
+        }
+        else {
+            for (; *in && *in != '\t'; in++) {
+                if (*in != '\\' || !in[1]) {
+                    *out++ = *in;
+                    continue;
+                }
+                switch (*++in) {
+                    case 'N':
+                    quoted = -1;
+                    continue;
+                    case 'b': *out++ = '\b'; break;
+                    case 'f': *out++ = '\f'; break;
+                    case 'n': *out++ = '\n'; break;
+                    case 'r': *out++ = '\r'; break;
+                    case 't': *out++ = '\t'; break;
+                    case 'v': *out++ = '\v'; break;
+                    default: *out++ = *in;
+                }
+            }
+        }
+        if (*in) *in++ = 0;
+        else in = NULL;
+        *out = 0;
+        // unquoted empty CSV value or \N in text format means NULL
+        if (out == start &&
+                (copyMode == PG_COPY_CSV ? !quoted : quoted < 0)) {
+            copyHandler(copyCtx, field, NULL, -1);
+        }
+        else {
+            copyHandler(copyCtx, field, start, out - start);
+        }
+        if (!in) break;
+    }
+    copyHandler(copyCtx, -1, NULL, 0);
+}
+
+/*
+ * both functions scan input once: for counting if outbuf is NULL
+ * or while copying otherwise. Runs of characters which need
+ * no escaping are found by pg_scan and copied as blocks.
+ */
+int PGconnection::escapeName(const char *inbuf, char *outbuf)
+{
+    const char *c, *run;
+    char *o;
+    int l = 2;
+    if (!outbuf) {
+        for (c = inbuf;; c++) {
+            run = c;
+            c = pg_scan(c, '"');
+            l += c - run;
+            if (!*c) break;
+            l += 2;
+        }
+        return l;
+    }
+    o = outbuf;
+    *o++ = '"';
+    for (c = inbuf;; c++) {
+        run = c;
+        c = pg_scan(c, '"');
+        memcpy(o, run, c - run);
+        o += c - run;
+        if (!*c) break;
+        *o++ = *c;
+        *o++ = *c;
+    }
+    *o++ = '"';
+    return o - outbuf;
+}
+
+int PGconnection::escapeString(const char *inbuf, char *outbuf)
+{
+    const char *c, *run;
+    char *o;
+    int e = 0, l = 2;
+    if (!outbuf) {
+        for (c = inbuf;; c++) {
+            run = c;
+            c = pg_scan(c, '\'');
+            l += c - run;
+            if (!*c) break;
+            if (*c == '\\') e = 2;
+            l += 2;
+        }
+        return l + e;
+    }
+    o = outbuf;
+    *o++ = '\'';
+    for (c = inbuf;; c++) {
+        run = c;
+        c = pg_scan(c, '\'');
+        memcpy(o, run, c - run);
+        o += c - run;
+        if (!*c) break;
+        if (*c == '\\' && !e) {
+            // backslash needs E prefix, rarely happens
+            e = 1;
+            memmove(outbuf + 2, outbuf, o - outbuf);
+            outbuf[0] = ' ';
+            outbuf[1] = 'E';
+            o += 2;
+        }
+        *o++ = *c;
+        *o++ = *c;
+    }
+    *o++ = '\'';
+    return o - outbuf;
+}
+
+char * PGconnection::getValue(int nr)
+{
+    if (!(result_status & PG_RSTAT_HAVE_ROW)) return NULL;
+    if (nr < 0 || nr >= _nfields) return NULL;
+    if (_fieldPos[nr].offset < 0 || _fieldPos[nr].length < 0) return NULL;
+    return Buffer + _fieldPos[nr].offset;
+}
+
+int PGconnection::getLength(int nr)
+{
+    if (!(result_status & (PG_RSTAT_HAVE_ROW | PG_RSTAT_HAVE_COLUMNS))) return -1;
+    if (nr < 0 || nr >= _nfields) return -1;
+    return _fieldPos[nr].length;
+}
+
+char *PGconnection::getColumn(int n)
+{
+    if (!(result_status & PG_RSTAT_HAVE_COLUMNS)) return NULL;
+    if (n < 0 || n >= _nfields) return NULL;
+    return Buffer + _fieldPos[n].offset;
+}
+
+int PGconnection::isBinary(int n)
+{
+    if (n < 0 || n >= _nfields) return 0;
+    if (_formats < 2) return _formats;
+    return _fieldType ? _fieldType[n].format : 0;
+}
+
+/*
+ * binary values are decoded by column type,
+ * value of other type or unexpected length gives zero
+ */
+int64_t PGconnection::getInt64(int n)
+{
+    const byte *c = (const byte *)getValue(n);
+    int64_t v;
+    int i;
+    if (!c) return 0;
+    if (!isBinary(n)) {
+        if (*c == 't') return 1; // bool in text form
+        return pg_atoll((const char *)c);
+    }
+    switch (pqOid(n)) {
+        case PG_OID_BOOL:
+        if (_fieldPos[n].length != 1) break;
+        return c[0] != 0;
+
+        case PG_OID_INT2:
+        if (_fieldPos[n].length != 2) break;
+        return (int16_t)((c[0] << 8) | c[1]);
+
+        case PG_OID_INT4:
+        case PG_OID_DATE:
+        if (_fieldPos[n].length != 4) break;
+        return (int32_t)(((uint32_t)c[0] << 24) | ((uint32_t)c[1] << 16) |
+            ((uint32_t)c[2] << 8) | c[3]);
+
+        case PG_OID_OID:
+        if (_fieldPos[n].length != 4) break;
+        return ((uint32_t)c[0] << 24) | ((uint32_t)c[1] << 16) |
+            ((uint32_t)c[2] << 8) | c[3];
+
+        case PG_OID_INT8:
+        case PG_OID_TIMESTAMP:
+        case PG_OID_TIMESTAMPTZ:
+        if (_fieldPos[n].length != 8) break;
+        for (v = 0, i = 0; i < 8; i++) v = (v << 8) | c[i];
+        return v;
+
+        case PG_OID_FLOAT4:
+        case PG_OID_FLOAT8:
+        return (int64_t)getDouble(n);
+    }
+    return 0;
+}
+
+int32_t PGconnection::getInt32(int n)
+{
+    return getInt64(n);
+}
+
+double PGconnection::getDouble(int n)
+{
+    const byte *c = (const byte *)getValue(n);
+    uint32_t hi, lo;
+    if (!c) return 0;
+    if (!isBinary(n)) return atof((const char *)c);
+    switch (pqOid(n)) {
+        case PG_OID_FLOAT4:
+        case PG_OID_FLOAT8:
+        break;
+
+        case PG_OID_BOOL:
+        case PG_OID_INT2:
+        case PG_OID_INT4:
+        case PG_OID_INT8:
+        case PG_OID_OID:
+        return getInt64(n);
+
+        default:
+        return 0;
+    }
+    hi = ((uint32_t)c[0] << 24) | ((uint32_t)c[1] << 16) |
+        ((uint32_t)c[2] << 8) | c[3];
+    if (pqOid(n) == PG_OID_FLOAT4) {
+        float f;
+        if (_fieldPos[n].length != 4) return 0;
+        memcpy(&f, &hi, 4);
+        return f;
+    }
+    if (_fieldPos[n].length != 8) return 0;
+    lo = ((uint32_t)c[4] << 24) | ((uint32_t)c[5] << 16) |
+        ((uint32_t)c[6] << 8) | c[7];
+#if __SIZEOF_DOUBLE__ == 8
+    {
+        uint64_t u = ((uint64_t)hi << 32) | lo;
+        double d;
+        memcpy(&d, &u, 8);
+        return d;
+    }
+#else
+    // AVR double is single precision, decode IEEE 754 binary64 by hand
+    {
+        int exp = (hi >> 20) & 0x7ff;
+        double m = (double)(hi & 0xfffff) * 4294967296.0 + lo;
+        if (exp == 0x7ff) return (hi & 0x80000000) ? -INFINITY : INFINITY;
+        if (exp) m = ldexp(m + 4503599627370496.0, exp - 1075);
+        else m = ldexp(m, -1074);
+        return (hi & 0x80000000) ? -m : m;
+    }
+#endif
+}
+
+int64_t PGconnection::getTimestamp(int n)
+{
+    const char *c = getValue(n);
+    int64_t v;
+    int32_t usec;
+    if (!c) return 0;
+    if (isBinary(n)) {
+        switch (pqOid(n)) {
+            case PG_OID_TIMESTAMP:
+            case PG_OID_TIMESTAMPTZ:
+            // microseconds since 2000-01-01
+            if (_fieldPos[n].length != 8) return 0;
+            return getInt64(n) + PG_EPOCH_OFFSET * 1000000LL;
+
+            case PG_OID_DATE:
+            // days since 2000-01-01
+            if (_fieldPos[n].length != 4) return 0;
+            return (getInt64(n) * 86400L + PG_EPOCH_OFFSET) * 1000000LL;
+        }
+        return 0;
+    }
+    if (pg_parse_timestamp(c, &v, &usec)) return 0;
+    return v * 1000000LL + usec;
+}
+
+uint32_t PGconnection::getType(int n)
+{
+    if (n < 0 || n >= _nfields) return 0;
+    return pqOid(n);
+}
+
+int PGconnection::getTypeLength(int n)
+{
+    if (!_fieldType || n < 0 || n >= _nfields) return -1;
+    return _fieldType[n].typlen;
+}
+
+int32_t PGconnection::getTypeModifier(int n)
+{
+    if (!_fieldType || n < 0 || n >= _nfields) return -1;
+    return _fieldType[n].typmod;
+}
+
+// classes of column types accepted by typed getters
+#define PG_TC_INT 1
+#define PG_TC_INT8 2
+#define PG_TC_FLOAT 4
+#define PG_TC_NUMERIC 8
+#define PG_TC_BOOL 16
+#define PG_TC_TIME 32
+
+static int pg_type_class(uint32_t oid)
+{
+    switch (oid) {
+        case PG_OID_INT2:
+        case PG_OID_INT4:
+        return PG_TC_INT;
+
+        case PG_OID_INT8:
+        return PG_TC_INT8;
+
+        case PG_OID_FLOAT4:
+        case PG_OID_FLOAT8:
+        return PG_TC_FLOAT;
+
+        case PG_OID_NUMERIC:
+        return PG_TC_NUMERIC;
+
+        case PG_OID_BOOL:
+        return PG_TC_BOOL;
+
+        case PG_OID_DATE:
+        case PG_OID_TIMESTAMP:
+        case PG_OID_TIMESTAMPTZ:
+        return PG_TC_TIME;
+    }
+    return 0;
+}
+
+/*
+ * checks if n-th value is available and column type
+ * is in one of classes
+ * returns zero if value may be parsed, 1 for NULL
+ * or negative value as typed getters
+ */
+int PGconnection::pqCheckType(int n, int classes)
+{
+    if (!(result_status & PG_RSTAT_HAVE_ROW)) return -1;
+    if (n < 0 || n >= _nfields) return -1;
+    if (!_fieldType || !(pg_type_class(_fieldType[n].oid) & classes)) return -2;
+    if (_fieldPos[n].length < 0) return 1;
+    if (_fieldPos[n].offset < 0) return -1; // passed to chunk handler
+    // binary numeric is not decoded
+    if (isBinary(n) && _fieldType[n].oid == PG_OID_NUMERIC) return -3;
+    return 0;
+}
+
+int PGconnection::getInt(int n, int32_t *value)
+{
+    int64_t v;
+    int rc;
+    *value = 0;
+    if ((rc = pqCheckType(n, PG_TC_INT))) return rc;
+    if ((rc = getLong(n, &v))) return rc;
+    if (v < INT32_MIN || v > INT32_MAX) return -3;
+    *value = v;
+    return 0;
+}
+
+int PGconnection::getLong(int n, int64_t *value)
+{
+    int rc;
+    *value = 0;
+    if ((rc = pqCheckType(n, PG_TC_INT | PG_TC_INT8))) return rc;
+    if (isBinary(n)) {
+        if (_fieldPos[n].length != _fieldType[n].typlen) return -3;
+        *value = getInt64(n);
+        return 0;
+    }
+    return pg_parse_int(Buffer + _fieldPos[n].offset, _fieldPos[n].length, value) ? -3 : 0;
+}
+
+int PGconnection::getFloat(int n, float *value)
+{
+    double d;
+    int64_t v;
+    int rc;
+    *value = 0;
+    if ((rc = pqCheckType(n, PG_TC_INT | PG_TC_INT8 | PG_TC_FLOAT | PG_TC_NUMERIC))) return rc;
+    if (isBinary(n)) {
+        if (_fieldPos[n].length != _fieldType[n].typlen) return -3;
+        *value = (pg_type_class(_fieldType[n].oid) & PG_TC_FLOAT) ? getDouble(n) : getInt64(n);
+        return 0;
+    }
+    if (pg_type_class(_fieldType[n].oid) & (PG_TC_FLOAT | PG_TC_NUMERIC)) {
+        rc = pg_parse_float(Buffer + _fieldPos[n].offset, _fieldPos[n].length, &d);
+        if (rc) return -3;
+        *value = d;
+        return 0;
+    }
+    if (pg_parse_int(Buffer + _fieldPos[n].offset, _fieldPos[n].length, &v)) return -3;
+    *value = v;
+    return 0;
+}
+
+int PGconnection::getBool(int n, int *value)
+{
+    const char *c;
+    int rc;
+    *value = 0;
+    if ((rc = pqCheckType(n, PG_TC_BOOL))) return rc;
+    c = Buffer + _fieldPos[n].offset;
+    if (_fieldPos[n].length != 1) return -3;
+    if (isBinary(n)) *value = *c != 0;
+    else if (*c == 't' || *c == 'f') *value = *c == 't';
+    else return -3;
+    return 0;
+}
+
+int PGconnection::getTimestampEpoch(int n, int64_t *value)
+{
+    const char *c;
+    int64_t v;
+    int32_t usec;
+    int rc;
+    *value = 0;
+    if ((rc = pqCheckType(n, PG_TC_TIME))) return rc;
+    c = Buffer + _fieldPos[n].offset;
+    if (isBinary(n)) {
+        if (_fieldPos[n].length != _fieldType[n].typlen) return -3;
+        v = getInt64(n);
+        if (_fieldType[n].oid == PG_OID_DATE) {
+            // days since 2000-01-01
+            *value = v * 86400L + PG_EPOCH_OFFSET;
+            return 0;
+        }
+        // microseconds since 2000-01-01, rounded down
+        *value = v / 1000000L - (v % 1000000L < 0) + PG_EPOCH_OFFSET;
+        return 0;
+    }
+    if (pg_parse_timestamp(c, &v, &usec)) return -3;
+    *value = v;
+    return 0;
+}
+
+char *PGconnection::getMessage(void)
+{
+    if (!(result_status & PG_RSTAT_HAVE_MESSAGE)) return NULL;
+    return Buffer;
+}
+
+int PGconnection::getData(void)
+{
+    int rc;
+    char *c;
+    if (txLen && flush()) return -1;
+    if ((result_status & PG_RSTAT_COPY_IN) && copyFlush()) {
+        setMsg_P(EM_WRITE, PG_RSTAT_HAVE_ERROR);
+        conn_status = CONNECTION_BAD;
+        return -1;
+    }
+    if (!_msgType) {
+        if (!pqAvailable()) return 0;
+        rc = pqGetHeader();
+        if (rc < 0) goto read_error;
+        if (!rc) return 0;
+    }
+    _qIndex = _qDone;
+    //Serial.printf("ID=%c\n", _msgType);
+    switch(_msgType) {
+        case 'T':
+        if ((rc=pqGetRowDescriptions()) <= 0) {
+            if (!rc) return 0;
+            if (rc == -2) setMsg_P(EM_OOM, PG_RSTAT_HAVE_ERROR);
+            else if (rc == -3) setMsg_P(EM_SYNC, PG_RSTAT_HAVE_ERROR);
+            goto read_error;
+        }
+        _msgType = 0;
+        if (_flags & PG_FLAG_IGNORE_COLUMNS) {
+            result_status &= ~PG_RSTAT_HAVE_MASK;
+            return 0;
+        }
+        return result_status = (result_status & ~PG_RSTAT_HAVE_MASK) | PG_RSTAT_HAVE_COLUMNS;
+
+        case 'E':
+        pqFreeTables(); // error ends result, message may use whole Buffer
+        _result = NULL;
+        if (_portal) _portal = PG_PORTAL_DONE;
+        if ((rc = pqGetNotice(PG_RSTAT_HAVE_ERROR)) <= 0) {
+            if (!rc) return 0;
+            goto read_error;
+        }
+        _msgType = 0;
+        return result_status;
+
+        case 'N':
+        case 'A':
+        if (_flags & PG_FLAG_IGNORE_NOTICES) {
+            if (pqSkipnchar(_msgLen) < 0) goto read_error;
+            if (!_msgLen) _msgType = 0;
+            return 0;
+        }
+        if (_msgType == 'N') {
+            rc = pqGetNotice(PG_RSTAT_HAVE_NOTICE);
+        }
+        else {
+            rc = pqGetNotify();
+        }
+        if (rc <= 0) {
+            if (!rc) return 0;
+            goto read_error;
+        }
+        _msgType = 0;
+        return result_status = (result_status & ~PG_RSTAT_HAVE_MASK) | PG_RSTAT_HAVE_NOTICE;
+
+        case 'Z':
+        if (pqSkipnchar(_msgLen) < 0) goto read_error;
+        if (_msgLen) return 0;
+        _msgType = 0;
+        pqFreeTables(); // result is complete
+        _result = NULL;
+        if (_qDone != _qSent) _qDone++;
+        if (!(_flags & PG_FLAG_PIPELINE)) {
+            result_status = (result_status & PG_RSTAT_HAVE_SUMMARY) | PG_RSTAT_READY;
+            return PG_RSTAT_READY;
+        }
+        result_status = (result_status & PG_RSTAT_HAVE_SUMMARY) | PG_RSTAT_QUERY_DONE |
+            (_qDone == _qSent ? PG_RSTAT_READY : PG_RSTAT_COMMAND_SENT);
+        return result_status & ~PG_RSTAT_HAVE_SUMMARY;
+
+        case 's': // portal suspended, types are kept for next batch
+        if (pqSkipnchar(_msgLen) < 0) goto read_error;
+        if (_msgLen) return 0;
+        _msgType = 0;
+        if (_portal == PG_PORTAL_FETCH) _portal = PG_PORTAL_IDLE;
+        return result_status = (result_status & ~PG_RSTAT_HAVE_MASK) | PG_RSTAT_SUSPENDED;
+
+        case 'S': // parameters setting ignored
+        case 'K': // should not be here?
+        case '1': // parse complete
+        case '2': // bind complete
+        case '3': // close complete
+        case 'n': // no data
+        case 't': // parameter description
+        if (pqSkipnchar(_msgLen) < 0) goto read_error;
+        if (!_msgLen) _msgType = 0;
+        return 0;
+
+        case 'C': // summary
+        if (!_step) {
+            if (_msgLen > bufSize - 1) goto oom;
+            _bufpos = 0;
+            _step = 1;
+        }
+        if ((rc = pqGetnchar(Buffer + _bufpos, _msgLen)) < 0) goto read_error;
+        _bufpos += rc;
+        if (_msgLen) return 0;
+        _msgType = 0;
+        Buffer[_bufpos] = 0;
+        _ntuples = 0;
+        pqFreeTables();
+        _result = NULL;
+        if (_portal) _portal = PG_PORTAL_DONE;
+        result_status = (result_status & ~PG_RSTAT_HAVE_MASK) | PG_RSTAT_HAVE_SUMMARY;
         for (c = Buffer; *c && !isdigit(*c); c++);
         if (!*c) return result_status;
-        if (strncmp(Buffer,"SELECT ",7)) {
+        if (!strncmp(Buffer,"INSERT ",7)) { // skip oid
             for (; *c && isdigit(*c); c++);
             for (; *c && !isdigit(*c); c++);
         }
@@ -476,22 +1628,87 @@ int PGconnection::getData(void)
         return result_status;
 
         case 'D':
-        if ((rc=pqGetRow())) {
+#if PG_ROW_QUEUE
+        // decoded row waits for room in queue
+        if (_step < 0) goto queue_row;
+#endif
+        if ((rc = (rowHandler && !_result) ? pqVisitRow() : pqGetRow()) <= 0) {
+            if (!rc) return 0;
             if (rc == -2) setMsg_P(EM_OOM, PG_RSTAT_HAVE_ERROR);
             else if (rc == -3) setMsg_P(EM_SYNC, PG_RSTAT_HAVE_ERROR);
             goto read_error;
         }
-        if (_flags & PG_FLAG_IGNORE_COLUMNS) {
+        if (_result) {
+            _msgType = 0;
+            result_status &= ~PG_RSTAT_HAVE_MASK;
+            if (_result->pqPutRow(Buffer, _bufpos, _fieldPos, _nfields) >= 0) return 0;
+            setMsg_P(EM_OOM, PG_RSTAT_HAVE_ERROR);
+            return result_status;
+        }
+        if (rowHandler) {
+            _msgType = 0;
+            result_status &= ~PG_RSTAT_HAVE_MASK;
+            return 0;
+        }
+#if PG_ROW_QUEUE
+        if (rowQueue) {
+queue_row:
+            if ((rc = rowQueue->pqPutRow(Buffer, _bufpos, _fieldPos, _nfields)) <= 0) {
+                if (rc < 0) {
+                    // row larger than half of queue is dropped
+                    _msgType = 0;
+                    setMsg_P(EM_OOM, PG_RSTAT_HAVE_ERROR);
+                    return result_status;
+                }
+                _step = -1;
+                return 0;
+            }
+            _msgType = 0;
             result_status &= ~PG_RSTAT_HAVE_MASK;
             return 0;
         }
+#endif
+        _msgType = 0;
         return result_status = (result_status & ~PG_RSTAT_HAVE_MASK) | PG_RSTAT_HAVE_ROW;
 
         case 'I':
-        if (pqSkipnchar(msgLen)) goto read_error;
+        if (pqSkipnchar(_msgLen) < 0) goto read_error;
+        if (_msgLen) return 0;
+        _msgType = 0;
         setMsg_P(EM_EMPTY, PG_RSTAT_HAVE_ERROR);
         return result_status;
 
+        case 'G': // copy in response
+        if (pqSkipnchar(_msgLen) < 0) goto read_error;
+        if (_msgLen) return 0;
+        _msgType = 0;
+        bufPos = 5; // room for CopyData header
+        return result_status = (result_status & ~PG_RSTAT_HAVE_MASK) | PG_RSTAT_COPY_IN;
+
+        case 'H': // copy out response
+        if (pqSkipnchar(_msgLen) < 0) goto read_error;
+        if (_msgLen) return 0;
+        _msgType = 0;
+        copyPos = 0;
+        copyQuote = 0;
+        return result_status = (result_status & ~PG_RSTAT_HAVE_MASK) | PG_RSTAT_COPY_OUT;
+
+        case 'd': // copy data
+        if ((rc = pqGetCopyData()) <= 0) {
+            if (!rc) return 0;
+            if (rc == -2) setMsg_P(EM_OOM, PG_RSTAT_HAVE_ERROR);
+            goto read_error;
+        }
+        _msgType = 0;
+        return 0;
+
+        case 'c': // copy done
+        if (pqSkipnchar(_msgLen) < 0) goto read_error;
+        if (_msgLen) return 0;
+        _msgType = 0;
+        result_status &= ~PG_RSTAT_COPY_OUT;
+        return 0;
+
         default:
         setMsg_P(EM_SYNC, PG_RSTAT_HAVE_ERROR);
         conn_status = CONNECTION_BAD;
@@ -511,20 +1728,17 @@ read_error:
 
 int PGconnection::executeFormat(int progmem, const char *format, ...)
 {
-    int32_t msgLen;
+    PGformatter out;
     va_list va;
-    va_start(va, format);
-    msgLen = writeFormattedQuery(0, progmem, format, va);
-    va_end(va);
-    if (msgLen < 0) return -1;
-    va_start(va, format);
-    msgLen = writeFormattedQuery(msgLen, progmem, format, va);
-    va_end(va);
-    if (msgLen) {
-        return -1;
-    }
-    result_status = PG_RSTAT_COMMAND_SENT;
-    return 0;
+    int rc;
+    if ((rc = formatBegin(out)) != 0) return rc;
+    do {
+        va_start(va, format);
+        rc = formatRun(out, progmem, format, va);
+        va_end(va);
+        if (rc) return rc;
+    } while ((rc = formatEnd(out)) > 0);
+    return rc;
 }
 
 #ifdef ESP8266
@@ -545,8 +1759,13 @@ static const char *strchr_P(const char *str, char c)
 #endif
 
 
-int PGconnection::build_startup_packet(
+/*
+ * builds startup packet (without length) in packet
+ * or only computes its length if packet is NULL
+ */
+static int pg_startup_packet(
     char *packet,
+    const char *user,
     const char *db,
     const char *charset)
 {
@@ -574,8 +1793,8 @@ int PGconnection::build_startup_packet(
 		packet_len += strlen_P((char *)optval) + 1; \
 	} while(0)
 
-	if (_user && _user[0])
-		ADD_STARTUP_OPTION(PSTR("user"), _user);
+	if (user && user[0])
+		ADD_STARTUP_OPTION(PSTR("user"), user);
 	if (db && db[0])
 		ADD_STARTUP_OPTION(PSTR("database"), db);
 	if (charset && charset[0])
@@ -589,188 +1808,591 @@ int PGconnection::build_startup_packet(
 	return packet_len;
 }
 
-int PGconnection::pqPacketSend(char pack_type, const char *buf, int buf_len, int progmem)
-{
-    char *start = Buffer;
-    int l = bufSize - 4;
-    int n;
-    if (pack_type) {
-        *start++ = pack_type;
-        l--;
-    }
-#ifdef __AVR__
-    *start++=0;
-    *start++=0;
+int PGconnection::build_startup_packet(
+    char *packet,
+    const char *db,
+    const char *charset)
+{
+    return pg_startup_packet(packet, _user, db, charset);
+}
+
+PGprofile::PGprofile(void)
+{
+    packet = secret = NULL;
+    packetLen = 0;
+    port = 5432;
+}
+
+PGprofile::~PGprofile(void)
+{
+    clear();
+}
+
+void PGprofile::clear(void)
+{
+    if (secret) {
+        memset(secret, 0, strlen(secret));
+        free(secret);
+    }
+    free(packet);
+    packet = secret = NULL;
+    packetLen = 0;
+}
+
+int PGprofile::set(IPAddress server,
+    const char *user,
+    const char *passwd,
+    const char *db,
+    const char *charset,
+    int port)
+{
+    clear();
+    if (!db) db = user;
+    this->server = server;
+    this->port = port;
+    packetLen = pg_startup_packet(NULL, user, db, charset);
+    packet = (char *)malloc(packetLen);
+    if (!packet) return -1;
+    pg_startup_packet(packet, user, db, charset);
+    if (!passwd || !*passwd) return 0;
+#ifdef PG_USE_MD5
+    secret = (char *)malloc(MD5_PASSWD_LEN + 1);
+    if (!secret) return -1;
+    pg_md5_encrypt(passwd, (char *)user, strlen(user), secret);
 #else
-    *start++ = ((buf_len + 4) >> 24) & 0xff;
-    *start++ = ((buf_len + 4) >> 16) & 0xff;
+    secret = strdup(passwd);
+    if (!secret) return -1;
 #endif
-    *start++ = ((buf_len + 4) >> 8) & 0xff;
-    *start++ = (buf_len + 4) & 0xff;
+    return 0;
+}
+
+int PGconnection::pqPacketSend(char pack_type, const char *buf, int buf_len, int progmem)
+{
+    char hdr[5];
+    int32_t len = (int32_t)buf_len + 4;
+    int n = 0, rc;
+    if (pack_type) hdr[n++] = pack_type;
+    hdr[n++] = (len >> 24) & 0xff;
+    hdr[n++] = (len >> 16) & 0xff;
+    hdr[n++] = (len >> 8) & 0xff;
+    hdr[n++] = len & 0xff;
+#ifndef PG_CLIENT_WRITEV
+    /*
+     * without vectored write, message already built in Buffer
+     * (startup packet, password) gets header and pending data
+     * put in front of it and is written at once; other messages
+     * go through pqSend, which sends header together with the
+     * beginning of data
+     */
+    len = txLen + n;
+    if (buf && !progmem && Buffer && !_tables &&
+            buf >= Buffer + len && buf < Buffer + bufSize &&
+            txLen + n + buf_len > PG_SEND_SIZE) {
+        char *start = (char *)buf - len;
+        memcpy(start, txBuf, txLen);
+        memcpy(start + txLen, hdr, n);
+        len += buf_len;
+        txLen = 0;
+        if (client->write((const uint8_t *)start, len) != (size_t)len) return -1;
+        return 0;
+    }
+#endif
+    rc = pqSend(hdr, n);
+    if (!rc && buf && buf_len) {
 #ifndef ESP32
-    if (progmem) {
-        while (buf_len > 0) {
-            while (buf_len > 0 && l > 0) {
-                *start++ = pgm_read_byte(buf++);
-                buf_len--;
-            }
-            n = client->write((const uint8_t *)Buffer, start - Buffer);
-            if (n != start - Buffer) return -1;
-            start = Buffer;
-            l = bufSize;
-        }
+        if (progmem) rc = pqSend_P(buf, buf_len);
+        else
+#endif
+        rc = pqSend(buf, buf_len);
+    }
+    if (!rc) rc = pqMsgEnd();
+    return rc;
+}
+
+/*
+ * queues data for sending
+ * small pieces are collected in txBuf, larger ones are
+ * written directly (together with txBuf if client supports it)
+ */
+int PGconnection::pqSend(const char *buf, int len)
+{
+    int fill;
+    if (txLen + len <= PG_SEND_SIZE) {
+        memcpy(txBuf + txLen, buf, len);
+        txLen += len;
+        return 0;
+    }
+#ifdef PG_CLIENT_WRITEV
+    if (len >= PG_SEND_SIZE) {
+        size_t n = txLen + len;
+        txLen = 0;
+        if (client->writev((const uint8_t *)txBuf, n - len,
+                    (const uint8_t *)buf, len) != n) return -1;
+        return 0;
     }
-    else {
 #endif
-        if (buf) {
-            if (buf_len <= l) {
-                memcpy(start, buf, buf_len);
-                start += buf_len;
-                buf_len = 0;
-            }
-            else {
-                memcpy(start, buf, l);
-                start += l;
-                buf_len -= l;
-                buf += l;
-            }
-        }
-        n = client->write((const uint8_t *)Buffer, start - Buffer);
-        if (n != start - Buffer) return -1;
-        if (buf && buf_len) {
-            n = client->write((const uint8_t *)buf, buf_len);
-            if (n != buf_len) return -1;
-        }
+    // fill txBuf first, so pending message header goes
+    // together with beginning of data
+    if (txLen) {
+        fill = PG_SEND_SIZE - txLen;
+        memcpy(txBuf + txLen, buf, fill);
+        txLen = PG_SEND_SIZE;
+        buf += fill;
+        len -= fill;
+        if (pqFlush()) return -1;
+    }
+    if (len < PG_SEND_SIZE) {
+        memcpy(txBuf, buf, len);
+        txLen = len;
+        return 0;
+    }
+    if (client->write((const uint8_t *)buf, len) != (size_t)len) return -1;
+    return 0;
+}
+
 #ifndef ESP32
+int PGconnection::pqSend_P(const char *buf, int len)
+{
+    while (len > 0) {
+        if (txLen >= PG_SEND_SIZE && pqFlush()) return -1;
+        txBuf[txLen++] = pgm_read_byte(buf++);
+        len--;
     }
+    return 0;
+}
 #endif
+
+int PGconnection::pqFlush(void)
+{
+    int n = txLen;
+    txLen = 0;
+    if (n && client->write((const uint8_t *)txBuf, n) != (size_t)n) return -1;
     return 0;
 }
 
-int PGconnection::pqGetc(char *buf)
+/*
+ * called after complete message
+ * sends collected data unless coalescing is requested
+ */
+int PGconnection::pqMsgEnd(void)
 {
-    int i;
-    for (i=0; !client->available() && i < 10; i++) {
-        delay (i * 10 + 10);
+    if (_flags & PG_FLAG_COALESCE) return 0;
+    return pqFlush();
+}
+
+int PGconnection::flush(void)
+{
+    if (pqFlush()) {
+        setMsg_P(EM_WRITE, PG_RSTAT_HAVE_ERROR);
+        conn_status = CONNECTION_BAD;
+        return -1;
+    }
+    return 0;
+}
+
+int PGconnection::pqAvailable(void)
+{
+    if (rxPos < rxLen) return rxLen - rxPos;
+    return client->available();
+}
+
+/*
+ * refills receive window if empty
+ * returns number of bytes in window, zero if no data
+ * arrived yet or -1 on read error
+ */
+int PGconnection::pqFill(void)
+{
+    int n;
+    if (rxPos < rxLen) return rxLen - rxPos;
+    rxPos = rxLen = 0;
+    n = client->available();
+    if (n <= 0) {
+        if (!client->connected()) return -1;
+        return 0;
     }
-    if (!client->available()) {
+    if (n > PG_RECV_SIZE) n = PG_RECV_SIZE;
+    n = client->read((uint8_t *)rxBuf, n);
+    if (n <= 0) return -1;
+    rxLen = n;
+    return n;
+}
+
+/*
+ * makes n bytes available in window as contiguous block
+ * returns 1 on success, zero if not enough data arrived yet
+ * or -1 on read error
+ */
+int PGconnection::pqNeed(int n)
+{
+    int avail;
+    if (rxLen - rxPos >= n) return 1;
+    if (rxPos) {
+        memmove(rxBuf, rxBuf + rxPos, rxLen - rxPos);
+        rxLen -= rxPos;
+        rxPos = 0;
+    }
+    avail = client->available();
+    if (avail <= 0) {
+        if (!client->connected()) return -1;
+        return 0;
+    }
+    if (avail > PG_RECV_SIZE - rxLen) avail = PG_RECV_SIZE - rxLen;
+    avail = client->read((uint8_t *)rxBuf + rxLen, avail);
+    if (avail <= 0) return -1;
+    rxLen += avail;
+    return rxLen >= n;
+}
+
+/*
+ * reads message type and length
+ * returns 1 if header was read, zero if not enough data
+ * or -1 on error
+ */
+int PGconnection::pqGetHeader(void)
+{
+    int rc;
+    int32_t len;
+    if ((rc = pqNeed(5)) <= 0) return rc;
+    _msgType = rxBuf[rxPos++];
+    _msgLen = 4;
+    pqGetInt4(&len);
+    _msgLen = len - 4;
+    _step = 0;
+    if (_msgLen < 0) {
+        _msgType = 0;
         return -1;
     }
-    *buf = client->read();
+    return 1;
+}
+
+/*
+ * pqGetc, pqGetInt2 and pqGetInt4 read data already
+ * present in window (see pqNeed)
+ */
+
+int PGconnection::pqGetc(char *buf)
+{
+    if (rxPos >= rxLen || _msgLen < 1) return -1;
+    *buf = rxBuf[rxPos++];
+    _msgLen--;
     return 0;
 }
 
 int PGconnection::pqGetInt4(int32_t *result)
 {
-	uint32_t tmp4 = 0;
-    byte tmp,i;
-    for (i = 0; i < 4; i++) {
-        if (pqGetc((char *)&tmp)) return -1;
-        tmp4 = (tmp4 << 8) | tmp;
-    }
-    *result = tmp4;
+    const byte *c = (const byte *)rxBuf + rxPos;
+    if (rxLen - rxPos < 4 || _msgLen < 4) return -1;
+    *result = ((uint32_t)c[0] << 24) | ((uint32_t)c[1] << 16) |
+        ((uint32_t)c[2] << 8) | c[3];
+    rxPos += 4;
+    _msgLen -= 4;
     return 0;
 }
 
 int PGconnection::pqGetInt2(int16_t *result)
 {
-	uint16_t tmp2 = 0;
-    byte tmp,i;
-    for (i = 0; i < 2; i++) {
-        if (pqGetc((char *)&tmp)) return -1;
-        tmp2 = (tmp2 << 8) | tmp;
-    }
-    *result = tmp2;
+    const byte *c = (const byte *)rxBuf + rxPos;
+    if (rxLen - rxPos < 2 || _msgLen < 2) return -1;
+    *result = (c[0] << 8) | c[1];
+    rxPos += 2;
+    _msgLen -= 2;
     return 0;
 }
 
+/*
+ * copies up to len bytes of current message
+ * returns number of bytes copied (zero if no data arrived yet)
+ * or -1 on read error
+ */
 int PGconnection::pqGetnchar(char *s, int len)
 {
-    while (len-- > 0) {
-        if (pqGetc(s++)) return -1;
+    int n, done = 0;
+    if (len > _msgLen) len = _msgLen;
+    while (len > 0) {
+        if ((n = pqFill()) <= 0) {
+            if (n < 0) return -1;
+            break;
+        }
+        if (n > len) n = len;
+        memcpy(s, rxBuf + rxPos, n);
+        rxPos += n;
+        _msgLen -= n;
+        s += n;
+        len -= n;
+        done += n;
     }
-    return 0;
+    return done;
 }
 
-int PGconnection::pqGets(char *s, int maxlen)
+/*
+ * reads zero-terminated string from current message
+ * into Buffer at _bufpos (or skips it if store is zero).
+ * returns 1 if whole string was read, zero if not enough data,
+ * -1 on read error, -2 if string doesn't fit in Buffer
+ * or -3 if string exceeds message
+ */
+int PGconnection::pqGets(int store)
 {
-    int len;
-    char z;
-    for (len = 0;len < maxlen; len++) {
-        if (pqGetc(&z)) return -1;
-        if (s) *s++ = z;
-        if (!z) return len+1;
+    int n;
+    const char *z;
+    for (;;) {
+        if (!_msgLen) return -3;
+        if ((n = pqFill()) <= 0) return n;
+        if (n > _msgLen) n = _msgLen;
+        z = (const char *)memchr(rxBuf + rxPos, 0, n);
+        if (z) n = z - (rxBuf + rxPos) + 1;
+        if (store) {
+            if (_bufpos + n > pqBufEnd()) return -2;
+            memcpy(Buffer + _bufpos, rxBuf + rxPos, n);
+            _bufpos += n;
+        }
+        rxPos += n;
+        _msgLen -= n;
+        if (z) return 1;
     }
-    return - (len + 1);
 }
 
+/*
+ * skips up to len bytes of current message
+ * returns number of bytes skipped or -1 on read error
+ */
 int PGconnection::pqSkipnchar(int len)
 {
-    char dummy;
-    while (len-- > 0) {
-        if (pqGetc(&dummy)) return -1;
+    int n, done = 0;
+    if (len > _msgLen) len = _msgLen;
+    while (len > 0) {
+        if ((n = pqFill()) <= 0) {
+            if (n < 0) return -1;
+            break;
+        }
+        if (n > len) n = len;
+        rxPos += n;
+        _msgLen -= n;
+        len -= n;
+        done += n;
+    }
+    return done;
+}
+
+/*
+ * Message body decoders below may be called many times
+ * for single message, until all data arrive. They return
+ * 1 if message is complete, zero if more data is needed
+ * or negative value on error.
+ */
+
+/*
+ * places table of value positions at the end of Buffer
+ * and below it table of column types (types = 2),
+ * type OIDs only (types = 1) or nothing (types = 0)
+ * returns -1 if there is no room for them
+ */
+int PGconnection::pqSetFieldPos(int types)
+{
+    // room is counted in bytes before any pointer is formed,
+    // so field count sent by server cannot wrap address around
+    uint32_t size, off = bufSize;
+    unsigned int pad;
+
+    pqFreeTables();
+    size = (uint32_t)_nfields * sizeof(PGfieldPos);
+    if (size >= off) return -1;
+    off -= size;
+    pad = ((uintptr_t)Buffer + off) & (sizeof(int) - 1);
+    if (pad >= off) return -1;
+    off -= pad;
+    _fieldPos = (PGfieldPos *)(Buffer + off);
+    if (types) {
+        size = (uint32_t)_nfields * (types > 1 ? sizeof(PGfieldType) : sizeof(uint32_t));
+        if (size >= off) return -1;
+        off -= size;
+        pad = ((uintptr_t)Buffer + off) & (sizeof(uint32_t) - 1);
+        if (pad >= off) return -1;
+        off -= pad;
+        if (types > 1) _fieldType = (PGfieldType *)(Buffer + off);
+        else _fieldOid = (uint32_t *)(Buffer + off);
     }
+    _tables = Buffer + off;
     return 0;
 }
 
 int PGconnection::pqGetRow(void)
 {
-    int i;
-    int bufpos = 0;
-    int32_t len;
+    int rc;
+    int16_t cols = 0;
+
+    for (;;) switch (_step) {
+        case 0:
+        if ((rc = pqNeed(2)) <= 0) return rc;
+        pqGetInt2(&cols);
+        if (cols != _nfields) {
+            return -3;
+        }
+        // rows keep layout of row description
+        if (pqSetFieldPos(_fieldType ? 2 : _fieldOid ? 1 : 0)) return -2;
+        _field = 0;
+        _bufpos = 0;
+        _step = 1;
+        break;
+
+        case 1:
+        if (_field >= _nfields) {
+            return _msgLen ? -3 : 1;
+        }
+        if ((rc = pqNeed(4)) <= 0) return rc;
+        if (pqGetInt4(&_fieldLen)) return -3;
+        _fieldPos[_field].offset = _bufpos;
+        _fieldPos[_field].length = _fieldLen < 0 ? -1 : _fieldLen;
+        if (_fieldLen < 0) {
+            _field++;
+            break;
+        }
+        if (_fieldLen > _msgLen) return -3;
+        if (_bufpos + _fieldLen + 1 > pqBufEnd()) {
+            if (!chunkHandler) return -2;
+            _fieldPos[_field].offset = -1;
+#if !PG_WIDE_FIELDS
+            if (_fieldLen > 32767) _fieldPos[_field].length = 32767;
+#endif
+            _chunkLen = _fieldLen;
+            _step = 3;
+            break;
+        }
+        _step = 2;
+        break;
+
+        case 2:
+        rc = pqGetnchar(Buffer + _bufpos, _fieldLen);
+        if (rc < 0) return -1;
+        _bufpos += rc;
+        _fieldLen -= rc;
+        if (_fieldLen) return 0;
+        Buffer[_bufpos++]=0;
+        _field++;
+        _step = 1;
+        break;
+
+        case 3:
+        // value too large for buffer, passed in slices from receive window
+        if ((rc = pqFill()) <= 0) return rc;
+        if (rc > _fieldLen) rc = _fieldLen;
+        chunkHandler(chunkCtx, _field, rxBuf + rxPos, rc,
+                _chunkLen - _fieldLen, _chunkLen);
+        rxPos += rc;
+        _msgLen -= rc;
+        _fieldLen -= rc;
+        if (_fieldLen) break;
+        _field++;
+        _step = 1;
+        break;
+    }
+}
+
+/*
+ * passes row to row handler
+ * if whole message fits in receive window values are passed
+ * in place, otherwise row is collected in Buffer first
+ */
+int PGconnection::pqVisitRow(void)
+{
+    int rc, i;
     int16_t cols;
+    int32_t len;
 
-    _null = 0;
-    if (pqGetInt2(&cols)) return -1;
-    if (cols != _nfields) {
-        return -3;
-    }
-    for (i=0; i < _nfields; i++) {
-        if (pqGetInt4(&len)) return -1;
-        if (len < 0) {
-            _null |= 1<<i;
-            continue;
+    if (!_step && _msgLen <= PG_RECV_SIZE) {
+        if ((rc = pqNeed(_msgLen)) <= 0) return rc;
+        if (pqGetInt2(&cols) || cols != _nfields) return -3;
+        for (i = 0; i < cols; i++) {
+            if (pqGetInt4(&len) || len > _msgLen) return -3;
+            if (len < 0) {
+                rowHandler(rowCtx, i, NULL, -1, 1);
+                continue;
+            }
+            rowHandler(rowCtx, i, rxBuf + rxPos, len, 0);
+            rxPos += len;
+            _msgLen -= len;
         }
-        if (bufpos + len + 1 > bufSize) {
-            return -2;
+        if (_msgLen) return -3;
+    }
+    else {
+        if ((rc = pqGetRow()) <= 0) return rc;
+        for (i = 0; i < _nfields; i++) {
+            len = _fieldPos[i].length;
+            // streamed values were already passed to chunk handler
+            rowHandler(rowCtx, i, (len < 0 || _fieldPos[i].offset < 0) ? NULL :
+                    Buffer + _fieldPos[i].offset, len, len < 0);
         }
-        if (pqGetnchar(Buffer + bufpos, len)) return -1;
-        bufpos += len;
-        Buffer[bufpos++]=0;
     }
-    return 0;
+    rowHandler(rowCtx, -1, NULL, 0, 0);
+    return 1;
 }
 
-
 int PGconnection::pqGetRowDescriptions(void)
 {
-    int i;
-    int16_t format;
+    PGfieldType *type;
+    int32_t oid, typmod;
+    int16_t typlen, format;
     int rc;
-    int bufpos;
-    if (pqGetInt2(&_nfields)) return -1;
-    if (_nfields > PG_MAX_FIELDS) return -2; // implementation limit
-    _formats = 0;
-    bufpos = 0;
-    for (i = 0;i < _nfields; i++) {
+
+    for (;;) switch (_step) {
+        case 0:
+        if ((rc = pqNeed(2)) <= 0) return rc;
+        pqGetInt2(&_nfields);
+        if (_nfields < 0) return -3;
+        _formats = 0;
+        // type OIDs are needed only to decode binary results
+        if (pqSetFieldPos((_flags & PG_FLAG_COLUMN_TYPES) ? 2 :
+                    (_binary >> (_qDone & 31)) & 1)) return -2;
+        _field = 0;
+        _bufpos = 0;
+        _step = 1;
+        break;
+
+        case 1:
+        if (_field >= _nfields) {
+            if (_msgLen) return -3;
+            return 1;
+        }
+        _fieldPos[_field].offset = _bufpos;
+        _step = 3;
+        // fall through
+
+        case 3:
         if (!(_flags & PG_FLAG_IGNORE_COLUMNS)) {
-            if (bufpos >= bufSize - 1) return -2;
-            rc = pqGets(Buffer + bufpos, bufSize - bufpos);
-            if (rc < 0) return -1;
-            bufpos += rc;
+            rc = pqGets(1);
+            if (rc <= 0) return rc;
+            _fieldPos[_field].length = _bufpos - _fieldPos[_field].offset - 1;
+            if (_bufpos > pqBufEnd()) return -2;
         }
         else {
-            if (pqGets(NULL, 8192) < 0) {
-                return -1;
-            }
+            rc = pqGets(0);
+            if (rc <= 0) return rc;
         }
-        if (pqSkipnchar(16)) return -1;
-        if (pqGetInt2(&format)) return -1;
-        format = format ? 1 : 0;
-        _formats |= format << i;
+        _step = 2;
+        break;
+
+        case 2:
+        if ((rc = pqNeed(18)) <= 0) return rc;
+        // table OID and column number are not used
+        if (pqSkipnchar(6) != 6) return -3;
+        if (pqGetInt4(&oid) || pqGetInt2(&typlen) ||
+                pqGetInt4(&typmod) || pqGetInt2(&format)) return -3;
+        format = format != 0;
+        if (_fieldOid) _fieldOid[_field] = oid;
+        if (_fieldType) {
+            type = _fieldType + _field;
+            type->oid = oid;
+            type->typlen = typlen;
+            type->typmod = typmod;
+            type->format = format;
+        }
+        if (!_field) _formats = format;
+        else if (_formats != format) _formats = 2;
+        _field++;
+        _step = 1;
+        break;
     }
-    if (_formats) return -3;
-    return 0;
 }
 
 void PGconnection::setMsg(const char *s, int type)
@@ -787,235 +2409,834 @@ void PGconnection::setMsg_P(const char *s, int type)
 
 int PGconnection::pqGetNotice(int type)
 {
-    int bufpos = 0;
     char id;
     int rc;
-    for (;;) {
-        if (pqGetc(&id)) goto read_error;
-        if (!id) break;
+    for (;;) switch (_step) {
+        case 0:
+        _bufpos = 0;
+        _step = 1;
+        // fall through
+
+        case 1:
+        if ((rc = pqNeed(1)) <= 0) return rc;
+        if (pqGetc(&id)) return -3;
+        if (!id) {
+            if (_msgLen) return -3;
+            Buffer[_bufpos] = 0;
+            result_status = (result_status & ~PG_RSTAT_HAVE_MASK) | type;
+            return 1;
+        }
         if (id == 'S' || id == 'M') {
-            if (bufpos && bufpos < bufSize - 1) Buffer[bufpos++]=':';
-            rc = pqGets(Buffer + bufpos, bufSize - bufpos);
-            if (rc < 0) goto read_error;
-            bufpos += rc -1;
+            if (_bufpos && _bufpos < pqBufEnd() - 1) Buffer[_bufpos++]=':';
+            _step = 2;
         }
         else {
-            rc = pqGets(NULL, 8192);
-            if (rc < 0) goto read_error;
+            _step = 3;
         }
+        break;
+
+        case 2:
+        case 3:
+        rc = pqGets(_step == 2);
+        if (rc <= 0) return rc;
+        if (_step == 2) _bufpos--;
+        _step = 1;
+        break;
     }
-    Buffer[bufpos] = 0;
-    result_status = (result_status & ~PG_RSTAT_HAVE_MASK) | type;
-    return 0;
-
-read_error:
-    if (!bufpos) setMsg_P(EM_READ, PG_RSTAT_HAVE_ERROR);
-    return -1;
 }
 
-int PGconnection::pqGetNotify(int32_t msgLen)
+int PGconnection::pqGetNotify(void)
 {
     int32_t pid;
-    int bufpos, i;
-    if (pqGetInt4(&pid)) return -1;
-    msgLen -= 4;
-    bufpos = sprintf(Buffer,"%d:",pid);
-    if (msgLen > bufSize - (bufpos + 1)) {
-        if (pqGetnchar(Buffer+bufpos, bufSize - (bufpos + 1)))
-            return -1;
-        msgLen -= bufSize - (bufpos + 1);
-        if (pqSkipnchar(msgLen)) return -1;
-        Buffer[msgLen = bufSize - 1] = 0;
+    int rc, i;
 
+    if (!_step) {
+        if ((rc = pqNeed(4)) <= 0) return rc;
+        pqGetInt4(&pid);
+        _bufpos = sprintf(Buffer,"%d:",pid);
+        _step = 1;
     }
-    else {
-        if (pqGetnchar(Buffer+ bufpos, msgLen)) return -1;
-        Buffer[bufpos + msgLen] = 0;
-        msgLen += bufpos;
-    }
-    for (i=0; i<msgLen; i++) if (!Buffer[i]) Buffer[i] = ':';
-    return 0;
+    rc = pqGetnchar(Buffer + _bufpos, pqBufEnd() - (_bufpos + 1));
+    if (rc < 0) return -1;
+    _bufpos += rc;
+    // rest of message doesn't fit in Buffer
+    if (_bufpos >= pqBufEnd() - 1 && pqSkipnchar(_msgLen) < 0) return -1;
+    if (_msgLen) return 0;
+    Buffer[_bufpos] = 0;
+    for (i=0; i<_bufpos; i++) if (!Buffer[i]) Buffer[i] = ':';
+    return 1;
 }
 
 #ifndef ESP32
 int PGconnection::writeMsgPart_P(const char *s, int len, int fine)
 {
-    while (len > 0) {
-        if (bufPos >= bufSize) {
-            if (client->write((uint8_t *)Buffer, bufPos) != (size_t)bufPos) {
-                return -1;
-            }
-            bufPos = 0;
-        }
-        Buffer[bufPos++] = pgm_read_byte(s++);
-        len--;
-    }
-    if (bufPos && fine) {
-        if (client->write((uint8_t *)Buffer, bufPos) != (size_t)bufPos) {
-            return -1;
-        }
-        bufPos = 0;
-    }
-    return 0;
+    if (pqSend_P(s, len)) return -1;
+    return fine ? pqMsgEnd() : 0;
 }
 #endif
 
 int PGconnection::writeMsgPart(const char *s, int len, int fine)
 {
-    while (len > 0) {
-        int n = len;
-        if (n > bufSize - bufPos) n = bufSize - bufPos;
-        memcpy(Buffer + bufPos, s, n);
-        bufPos += n;
-        s += n;
-        len -= n;
-        if (bufPos >= bufSize) {
-            if (client->write((uint8_t *)Buffer, bufPos) != (size_t)bufPos) {
-                return -1;
-            }
-            bufPos = 0;
-        }
+    if (len && pqSend(s, len)) return -1;
+    return fine ? pqMsgEnd() : 0;
+}
+
+int PGconnection::writeMsgInt(int32_t n, int size)
+{
+    char buf[4];
+    int i;
+    for (i = size - 1; i >= 0; i--) {
+        buf[i] = n & 0xff;
+        n >>= 8;
     }
-    if (bufPos && fine) {
-        if (client->write((uint8_t *)Buffer, bufPos) != (size_t)bufPos) {
-            return -1;
+    return writeMsgPart(buf, size, false);
+}
+
+int PGconnection::writeMsgHeader(char type, int32_t len)
+{
+    int rc = writeMsgPart(&type, 1, false);
+    if (!rc) rc = writeMsgInt(len + 4, 4);
+    return rc;
+}
+
+/*
+ * formatter writes query into Buffer, leaving room for message header.
+ * If query doesn't fit, formatting is repeated (formatEnd returns 1)
+ * and query is sent while formatting, as its length is already known.
+ * While result is pending (pipeline mode) Buffer holds current row
+ * and field tables, and while message is partially received it may
+ * hold part of it, so query is always sent that way.
+ */
+int PGconnection::formatBegin(PGformatter &out)
+{
+    int rc;
+    if ((rc = pqCanSend()) != 0) return rc;
+    out.conn = this;
+    out.buf = Buffer + 5;
+    // message header and trailing zero
+    out.room = (_tables || _msgType) ? -1 : bufSize - 6;
+    out.len = 0;
+    out.stream = 0;
+    out.err = 0;
+    return 0;
+}
+
+int PGconnection::formatEnd(PGformatter &out)
+{
+    int32_t len;
+    if (!out.stream) {
+        if (out.len > out.room) {
+            out.stream = 1;
+            out.total = out.len;
+            out.len = 0;
+            if (writeMsgHeader('Q', out.total + 1)) goto write_error;
+            return 1;
         }
-        bufPos = 0;
+        len = out.len + 5;
+        Buffer[0] = 'Q';
+        Buffer[1] = (len >> 24) & 0xff;
+        Buffer[2] = (len >> 16) & 0xff;
+        Buffer[3] = (len >> 8) & 0xff;
+        Buffer[4] = len & 0xff;
+        Buffer[len] = 0;
+        if (pqSend(Buffer, len + 1) || pqMsgEnd()) goto write_error;
     }
-
+    else {
+        // arguments are the same, so is length
+        if (out.err || out.len != out.total ||
+                writeMsgPart("", 1, true)) goto write_error;
+    }
+    pqQuerySent();
     return 0;
+write_error:
+    setMsg_P(EM_WRITE, PG_RSTAT_HAVE_ERROR);
+    conn_status = CONNECTION_BAD;
+    return -1;
 }
 
-int32_t PGconnection::writeFormattedQuery(int32_t length, int progmem, const char *format, va_list va)
+int PGconnection::formatRun(PGformatter &out, int progmem, const char *format, va_list va)
 {
-    int32_t msgLen = 0;
     const char *percent;
-    int blen, rc;
-    char buf[32], znak;
+    char znak;
 #ifdef ESP32
-        (void) progmem;
+    (void) progmem;
 #endif
-    if (length) {
-        length += 4;
-        bufPos = 0;
-        Buffer[bufPos++] = 'Q';
-        Buffer[bufPos++] = (length >> 24) & 0xff;
-        Buffer[bufPos++] = (length >> 16) & 0xff;
-        Buffer[bufPos++] = (length >> 8) & 0xff;
-        Buffer[bufPos++] = (length) & 0xff;
-    }
     for (;;) {
 #ifndef ESP32
         if (progmem) {
             percent = strchr_P(format, '%');
+            if (!percent) {
+                out.put_P(format, strlen_P(format));
+                break;
+            }
+            out.put_P(format, percent - format);
+            znak = pgm_read_byte(percent + 1);
         }
         else {
 #endif
             percent = strchr(format, '%');
-#ifndef ESP32
-        }
-#endif
-        if (!percent) break;
-#ifndef ESP32
-        if (progmem) {
-            znak = pgm_read_byte(percent+1);
-        }
-        else {
-#endif
+            if (!percent) {
+                out.put(format, strlen(format));
+                break;
+            }
+            out.put(format, percent - format);
             znak = percent[1];
 #ifndef ESP32
         }
 #endif
-        if (!length) {
-            msgLen += (percent - format);
+        format = percent + 2;
+        switch (znak) {
+            case 's':
+            out.putLiteral(va_arg(va, const char *));
+            break;
+
+            case 'n':
+            out.putName(va_arg(va, const char *));
+            break;
+
+            case 'd':
+            out.putInt((int32_t)va_arg(va, int));
+            break;
+
+            case 'l':
+            if (sizeof(long) > 4) out.putInt((int64_t)va_arg(va, long));
+            else out.putInt((int32_t)va_arg(va, long));
+            break;
+
+            case '%':
+            out.put("%", 1);
+            break;
+
+            default:
+            setMsg_P(EM_FORMAT, PG_RSTAT_HAVE_ERROR);
+            return -1;
         }
-        else {
+    }
+    return 0;
+}
+
+/*
+ * data not fitting in buffer are counted only in first pass
+ * and sent directly in second one
+ */
+void PGformatter::putSlow(const char *s, int n)
+{
+    if (stream) {
+        if (!err && conn->pqSend(s, n)) err = 1;
+    }
+    len += n;
+}
+
 #ifndef ESP32
-            if (progmem) {
-                rc = writeMsgPart_P(format, percent - format, false);
-            }
-            else {
+void PGformatter::put_P(const char *s, int n)
+{
+    if (stream) {
+        if (!err && conn->pqSend_P(s, n)) err = 1;
+    }
+    else if (len + n <= room) {
+        memcpy_P(buf + len, s, n);
+    }
+    len += n;
+}
 #endif
-                rc = writeMsgPart(format, percent - format, false);
-#ifndef ESP32
+
+/*
+ * string literal in single pass, E prefix (if needed) is inserted
+ * when first backslash is found
+ */
+void PGformatter::putLiteral(const char *s)
+{
+    const char *run;
+    int start = len, e = 0;
+    char dbl[2];
+    if (stream && strchr(s, '\\')) {
+        put(" E", 2);
+        e = 1;
+    }
+    put("'", 1);
+    for (;;) {
+        run = s;
+        s = pg_scan(s, '\'');
+        put(run, s - run);
+        if (!*s) break;
+        if (*s == '\\' && !e) {
+            e = 1;
+            if (len + 2 <= room) {
+                memmove(buf + start + 2, buf + start, len - start);
+                buf[start] = ' ';
+                buf[start + 1] = 'E';
             }
-#endif
-            if (rc) goto write_error;
+            len += 2;
         }
-        format = percent + 2;
-        if (znak == 's' || znak == 'n') {
-            char *str = va_arg(va, char *);
-            blen = (znak == 's') ? escapeString(str, NULL) : escapeName(str, NULL);
-            if (!length) {
-                msgLen += blen;
-            }
-            else {
-                if (bufPos + blen > bufSize) {
-                    rc = writeMsgPart(NULL, 0, true);
-                    if (rc) goto write_error;
-                }
+        dbl[0] = dbl[1] = *s++;
+        put(dbl, 2);
+    }
+    put("'", 1);
+}
+
+void PGformatter::putName(const char *s)
+{
+    const char *run;
+    char dbl[2];
+    put("\"", 1);
+    for (;;) {
+        run = s;
+        s = pg_scan(s, '"');
+        put(run, s - run);
+        if (!*s) break;
+        dbl[0] = dbl[1] = *s++;
+        put(dbl, 2);
+    }
+    put("\"", 1);
+}
+
+// integers are quoted as in executeFormat
+void PGformatter::putNum(uint32_t u, int neg)
+{
+    char b[13];
+    int i = 12;
+    b[i--] = '\'';
+    do {
+        b[i--] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (neg) b[i--] = '-';
+    b[i] = '\'';
+    put(b + i, 13 - i);
+}
+
+void PGformatter::putNum(uint64_t u, int neg)
+{
+    char b[23];
+    int i = 22;
+    // values fitting in 32 bits avoid slow 64-bit division
+    if (u <= 0xffffffffUL) {
+        putNum((uint32_t)u, neg);
+        return;
+    }
+    b[i--] = '\'';
+    do {
+        b[i--] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (neg) b[i--] = '-';
+    b[i] = '\'';
+    put(b + i, 23 - i);
+}
+
+void PGformatter::putInt(int32_t n)
+{
+    putNum(n < 0 ? -(uint32_t)n : (uint32_t)n, n < 0);
+}
+
+void PGformatter::putInt(int64_t n)
+{
+    putNum(n < 0 ? -(uint64_t)n : (uint64_t)n, n < 0);
+}
+
+void PGformatter::putInt(uint64_t n)
+{
+    putNum(n, 0);
+}
+
+// states of pool members
+#define PG_POOL_DOWN 0
+#define PG_POOL_CONNECTING 1
+#define PG_POOL_IDLE 2
+#define PG_POOL_BUSY 3
+#define PG_POOL_DRAINING 4
+
+PGpool::PGpool(Client **clients, int size, int flags, int memory, char *arena)
+{
+    int i;
+    members = (Member *)malloc(size * sizeof(Member));
+    _size = members ? size : 0;
+    profile = NULL;
+    spares = 0;
+    if (arena && memory <= 0) arena = NULL;
+    for (i = 0; i < _size; i++) {
+        members[i].conn = new PGconnection(clients[i], flags, memory,
+                arena ? arena + i * memory : NULL);
+        members[i].client = clients[i];
+        members[i].retryAt = 0;
+        members[i].state = PG_POOL_DOWN;
+    }
+}
+
+PGpool::~PGpool(void)
+{
+    int i;
+    close();
+    for (i = 0; i < _size; i++) delete members[i].conn;
+    free(members);
+}
+
+void PGpool::setDbLogin(const PGprofile *profile, int spares)
+{
+    this->profile = profile;
+    this->spares = spares;
+}
+
+void PGpool::close(void)
+{
+    int i;
+    for (i = 0; i < _size; i++) {
+        if (members[i].state != PG_POOL_DOWN) members[i].conn->close();
+        members[i].state = PG_POOL_DOWN;
+        members[i].retryAt = 0;
+    }
+}
+
+/*
+ * starts connecting member
+ * returns 0 or -1 if connection failed immediately
+ */
+int PGpool::pqStart(Member *m)
+{
+    int rc = m->conn->setDbLogin(profile);
+    if (rc == CONNECTION_BAD || rc == CONNECTION_NEEDED) {
+        m->conn->close();
+        m->retryAt = millis() + PG_POOL_RETRY;
+        return -1;
+    }
+    m->state = PG_POOL_CONNECTING;
+    return 0;
+}
+
+int PGpool::poll(void)
+{
+    Member *m;
+    int i, rc, ready = 0, warm = 0, started = 0;
+    for (i = 0; i < _size; i++) {
+        m = members + i;
+        switch (m->state) {
+            case PG_POOL_CONNECTING:
+            rc = m->conn->status();
+            if (rc == CONNECTION_OK) m->state = PG_POOL_IDLE;
+            else if (rc == CONNECTION_BAD || rc == CONNECTION_NEEDED) {
+                m->conn->close();
+                m->state = PG_POOL_DOWN;
+                m->retryAt = millis() + PG_POOL_RETRY;
             }
-            if (znak == 's') {
-                escapeString(str, Buffer + bufPos);
+            break;
+
+            case PG_POOL_DRAINING:
+            rc = m->conn->getData();
+            if (rc < 0 || m->conn->status() == CONNECTION_BAD) {
+                m->conn->close();
+                m->state = PG_POOL_DOWN;
+                m->retryAt = 0;
             }
-            else {
-                escapeName(str, Buffer + bufPos);
+            else if (rc & PG_RSTAT_READY) m->state = PG_POOL_IDLE;
+            break;
+
+            case PG_POOL_IDLE:
+            // lost while idle, replace at once
+            if (!m->client->connected()) {
+                m->conn->close();
+                m->state = PG_POOL_DOWN;
+                m->retryAt = 0;
             }
-            bufPos += blen;
-            continue;
+            break;
         }
-        if (znak == 'l' || znak == 'd') {
-            if (znak == 'l') {
-                long n = va_arg(va, long);
-                blen = snprintf(buf, 32, "'%ld'", n);
-            }
-            else {
-                int n = va_arg(va, int);
-                blen = snprintf(buf, 32, "'%d'", n);
-            }
-            if (length) {
-                rc = writeMsgPart(buf, blen, false);
-                if (rc) goto write_error;
-            }
-            else {
-                msgLen += blen;
-            }
+        if (m->state == PG_POOL_IDLE) ready++;
+        if (m->state == PG_POOL_IDLE || m->state == PG_POOL_CONNECTING) warm++;
+    }
+    if (!profile || warm >= spares) return ready;
+    for (i = 0; i < _size && !started; i++) {
+        m = members + i;
+        if (m->state != PG_POOL_DOWN) continue;
+        if (m->retryAt && (long)(millis() - m->retryAt) < 0) continue;
+        pqStart(m);
+        started = 1;
+    }
+    return ready;
+}
+
+PGconnection *PGpool::acquire(void)
+{
+    int i;
+    poll();
+    for (i = 0; i < _size; i++) {
+        if (members[i].state == PG_POOL_IDLE) {
+            members[i].state = PG_POOL_BUSY;
+            return members[i].conn;
+        }
+    }
+    return NULL;
+}
+
+void PGpool::release(PGconnection *conn)
+{
+    Member *m;
+    int i;
+    for (i = 0; i < _size; i++) {
+        m = members + i;
+        if (m->conn != conn || m->state != PG_POOL_BUSY) continue;
+        if (conn->status() != CONNECTION_OK) {
+            conn->close();
+            m->state = PG_POOL_DOWN;
+            m->retryAt = 0;
+        }
+        else if (conn->dataStatus() & PG_RSTAT_READY) m->state = PG_POOL_IDLE;
+        else m->state = PG_POOL_DRAINING;
+        return;
+    }
+}
+
+/*
+ * value positions are kept relative to block beginning,
+ * so columnar() may move values without touching rows
+ */
+
+PGresult::PGresult(int memory, char *foreignBuffer)
+{
+    _own = !foreignBuffer;
+    arena = foreignBuffer ? foreignBuffer : (char *)malloc(memory);
+    // position table at aligned end
+    _end = arena ? (PGresultPos *)(((uintptr_t)(arena + memory)) &
+            ~(uintptr_t)(sizeof(int) - 1)) : NULL;
+    clear();
+}
+
+PGresult::~PGresult(void)
+{
+    if (_own) free(arena);
+}
+
+void PGresult::clear(void)
+{
+    _used = 0;
+    _nrows = 0;
+    _nfields = 0;
+    _full = 0;
+}
+
+/*
+ * returns 1 if row was stored, 0 if it was dropped
+ * or -1 if memory has just become full
+ */
+int PGresult::pqPutRow(const char *data, int len, const PGfieldPos *pos, int nfields)
+{
+    PGresultPos *p;
+    int i;
+
+    if (_full) return 0;
+    if (!arena) {
+        _full = 1;
+        return -1;
+    }
+    if (!_nrows) _nfields = nfields;
+    p = _end - (_nrows + 1) * _nfields;
+    if (nfields != _nfields || (char *)p < arena + _used + len) {
+        _full = 1;
+        return -1;
+    }
+    memcpy(arena + _used, data, len);
+    for (i = 0; i < nfields; i++) {
+        p[i].offset = pos[i].offset < 0 ? -1 : pos[i].offset + _used;
+        p[i].length = pos[i].length;
+    }
+    _used += len;
+    _nrows++;
+    return 1;
+}
+
+char *PGresult::getValue(int row, int col)
+{
+    PGresultPos *p;
+
+    if (row < 0 || row >= _nrows || col < 0 || col >= _nfields) return NULL;
+    p = pqPos(row, col);
+    if (p->length < 0 || p->offset < 0) return NULL;
+    return arena + p->offset;
+}
+
+int PGresult::getLength(int row, int col)
+{
+    if (row < 0 || row >= _nrows || col < 0 || col >= _nfields) return -1;
+    return pqPos(row, col)->length;
+}
+
+int PGresult::columnar(void)
+{
+    char *tmp = arena + _used;
+    PGresultPos *p;
+    int row, col, n = 0;
+
+    if (!arena || (char *)(_end - _nrows * _nfields) - tmp < _used) return -1;
+    for (col = 0; col < _nfields; col++) {
+        for (row = 0; row < _nrows; row++) {
+            p = pqPos(row, col);
+            if (p->length < 0 || p->offset < 0) continue;
+            // value with terminating zero
+            memcpy(tmp + n, arena + p->offset, p->length + 1);
+            p->offset = n;
+            n += p->length + 1;
         }
-        setMsg_P(EM_FORMAT, PG_RSTAT_HAVE_ERROR);
+    }
+    memcpy(arena, tmp, n);
+    return 0;
+}
+
+PGbatch::PGbatch(PGconnection *conn, const char *prefix, int nfields,
+        int memory, char *foreignBuffer)
+{
+    this->conn = conn;
+    _nfields = nfields;
+    _own = !foreignBuffer;
+    buffer = foreignBuffer ? foreignBuffer : (char *)malloc(memory);
+    _prefixLen = strlen(prefix);
+    _size = (buffer && _prefixLen < memory) ? memory : 0;
+    if (_size) memcpy(buffer, prefix, _prefixLen);
+    _pos = _prefixLen;
+    _rows = 0;
+    maxRows = 0;
+    maxBytes = 0;
+    maxAge = 0;
+    started = 0;
+    _err = 0;
+}
+
+PGbatch::~PGbatch(void)
+{
+    if (_own) free(buffer);
+}
+
+void PGbatch::setLimits(int rows, int bytes, unsigned long ms)
+{
+    maxRows = rows;
+    maxBytes = bytes;
+    maxAge = ms;
+}
+
+/*
+ * checks if connection is usable, sets error if not
+ * connection being established is only busy
+ */
+int PGbatch::pqCheckConn(void)
+{
+    if (conn->Buffer && conn->conn_status != CONNECTION_BAD &&
+            conn->conn_status != CONNECTION_NEEDED) return 0;
+    _err = PG_BATCH_NOCONN;
+    return -1;
+}
+
+int PGbatch::pqDue(void)
+{
+    return _rows && ((maxRows && _rows >= maxRows) ||
+            (maxBytes && _pos >= maxBytes) ||
+            (maxAge && millis() - started >= maxAge));
+}
+
+int PGbatch::addRow(const char * const *values)
+{
+    char *o;
+    int i, rc, len;
+
+    _err = 0;
+    if (!_size) {
+        _err = PG_BATCH_NOMEM;
         return -1;
     }
-#ifndef ESP32
-    if (progmem) {
-        blen = strlen_P(format);
+    if (pqCheckConn()) return -1;
+    // due rows must be sent first, so limits are never exceeded
+    if (pqDue() && (rc = flush()) != 0) return rc;
+    // parentheses and separators, then worst case of escaping
+    len = 2 + _nfields;
+    for (i = 0; i < _nfields; i++) {
+        len += values[i] ? 2 * strlen(values[i]) + 4 : 4;
     }
-    else {
-#endif
-        blen = strlen(format);
-#ifndef ESP32
+    if (_pos + len >= _size) {
+        // exact length, so buffer may be filled up
+        len = 2 + _nfields;
+        for (i = 0; i < _nfields; i++) {
+            len += values[i] ? conn->escapeString(values[i], NULL) : 4;
+        }
+        if (_prefixLen + len >= _size) {
+            _err = PG_BATCH_NOMEM;
+            return -1;
+        }
+        if (_pos + len >= _size && (rc = flush()) != 0) return rc;
     }
-#endif
-    if (length) {
-#ifndef ESP32
-        if (progmem) {
-            rc = writeMsgPart_P(format, blen, false);
+    o = buffer + _pos;
+    if (_rows) *o++ = ',';
+    *o++ = '(';
+    for (i = 0; i < _nfields; i++) {
+        if (i) *o++ = ',';
+        if (values[i]) {
+            o += conn->escapeString(values[i], o);
         }
         else {
-#endif
-            rc = writeMsgPart(format, blen, false);
-#ifndef ESP32
+            memcpy(o, "NULL", 4);
+            o += 4;
         }
-#endif
-        if (!rc) {
-            rc = writeMsgPart("\0",1,true);
+    }
+    *o++ = ')';
+    _pos = o - buffer;
+    if (!_rows++) started = millis();
+    if (pqDue() && (rc = flush()) < 0) return rc;
+    return 0;
+}
+
+int PGbatch::flush(void)
+{
+    int rc;
+
+    _err = 0;
+    if (pqCheckConn()) return -1;
+    if (!_rows) return 0;
+    if (!conn->pqSendable()) return 1;
+    buffer[_pos] = 0;
+    if ((rc = conn->execute(buffer)) != 0) return rc;
+    _pos = _prefixLen;
+    _rows = 0;
+    return 0;
+}
+
+int PGbatch::poll(void)
+{
+    _err = 0;
+    if (pqCheckConn()) return -1;
+    return pqDue() ? flush() : 0;
+}
+
+#if PG_ROW_QUEUE
+/*
+ * Ring records are 4-byte aligned: record length (0 marks wrap
+ * to ring beginning), number of fields (-1 for end mark), then
+ * field positions and row data as in internal buffer, or end
+ * mark value. Head is written only by producer, tail only by
+ * consumer; each side caches last seen position of the other.
+ */
+
+#define PG_QUEUE_ALIGN(n) (((n) + 3) & ~3)
+#define PG_QUEUE_HDR 8
+
+PGrowQueue::PGrowQueue(char *memory, int size)
+{
+    ring = (char *)(((uintptr_t)memory + 3) & ~(uintptr_t)3);
+    size -= ring - memory;
+    _size = size > 0 ? size & ~3 : 0;
+    _next = _tail = _head = 0;
+    _rec = NULL;
+    head.store(0, std::memory_order_relaxed);
+    tail.store(0, std::memory_order_relaxed);
+}
+
+/*
+ * returns place for record of len bytes or NULL if queue is full
+ * head never reaches tail, so equal positions mean empty queue
+ */
+char *PGrowQueue::pqReserve(int len)
+{
+    uint32_t h = head.load(std::memory_order_relaxed);
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (h >= _tail) {
+            if (h + len < _size || (h + len == _size && _tail)) {
+                _next = (h + len) % _size;
+                return ring + h;
+            }
+            if ((uint32_t)len < _tail) {
+                *(uint32_t *)(ring + h) = 0;
+                _next = len;
+                return ring;
+            }
         }
-        if (rc) goto write_error;
+        else if (h + len < _tail) {
+            _next = h + len;
+            return ring + h;
+        }
+        // cached tail may be stale
+        if (i == 0) _tail = tail.load(std::memory_order_acquire);
     }
-    else {
-        msgLen += blen + 1;
+    return NULL;
+}
+
+/*
+ * returns 1 if row was queued, 0 if queue is full
+ * or -1 if row is too large
+ */
+int PGrowQueue::pqPutRow(const char *data, int len, const PGfieldPos *pos, int nfields)
+{
+    int plen = nfields * sizeof(PGfieldPos);
+    int rlen = PG_QUEUE_ALIGN(PG_QUEUE_HDR + plen + len);
+    char *rec;
+
+    // empty queue must have room for record wherever its head is
+    if ((uint32_t)rlen * 2 >= _size) return -1;
+    if (!(rec = pqReserve(rlen))) return 0;
+    ((uint32_t *)rec)[0] = rlen;
+    ((int32_t *)rec)[1] = nfields;
+    memcpy(rec + PG_QUEUE_HDR, pos, plen);
+    memcpy(rec + PG_QUEUE_HDR + plen, data, len);
+    head.store(_next, std::memory_order_release);
+    return 1;
+}
+
+int PGrowQueue::putEnd(int32_t value)
+{
+    char *rec;
+
+    if (!(rec = pqReserve(PG_QUEUE_HDR + 4))) return 0;
+    ((uint32_t *)rec)[0] = PG_QUEUE_HDR + 4;
+    ((int32_t *)rec)[1] = -1;
+    ((int32_t *)rec)[2] = value;
+    head.store(_next, std::memory_order_release);
+    return 1;
+}
+
+int PGrowQueue::peek(void)
+{
+    uint32_t t = tail.load(std::memory_order_relaxed);
+
+    if (t == _head && t == (_head = head.load(std::memory_order_acquire))) return 0;
+    if (!*(uint32_t *)(ring + t)) {
+        // wrap mark, record is at ring beginning
+        t = 0;
+        tail.store(0, std::memory_order_release);
     }
-    return msgLen;
-write_error:
-    setMsg_P(EM_WRITE, PG_RSTAT_HAVE_ERROR);
-    conn_status = CONNECTION_BAD;
-    return -1;
+    _rec = ring + t;
+    return ((int32_t *)_rec)[1] < 0 ? 2 : 1;
+}
+
+void PGrowQueue::pop(void)
+{
+    uint32_t t;
+
+    if (!_rec) return;
+    t = _rec - ring + *(uint32_t *)_rec;
+    _rec = NULL;
+    tail.store(t == _size ? 0 : t, std::memory_order_release);
 }
+
+int PGrowQueue::nfields(void)
+{
+    if (!_rec || ((int32_t *)_rec)[1] < 0) return 0;
+    return ((int32_t *)_rec)[1];
+}
+
+int PGrowQueue::getLength(int n)
+{
+    if (n < 0 || n >= nfields()) return -1;
+    return ((PGfieldPos *)(_rec + PG_QUEUE_HDR))[n].length;
+}
+
+char *PGrowQueue::getValue(int n)
+{
+    PGfieldPos *pos;
+
+    if (n < 0 || n >= nfields()) return NULL;
+    pos = (PGfieldPos *)(_rec + PG_QUEUE_HDR) + n;
+    if (pos->length < 0 || pos->offset < 0) return NULL;
+    return _rec + PG_QUEUE_HDR + nfields() * sizeof(PGfieldPos) + pos->offset;
+}
+
+int32_t PGrowQueue::endValue(void)
+{
+    if (!_rec || ((int32_t *)_rec)[1] >= 0) return 0;
+    return ((int32_t *)_rec)[2];
+}
+#endif
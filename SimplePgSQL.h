@@ -38,6 +38,25 @@
 #include <Arduino.h>
 #include <Client.h>
 
+// PGrowQueue passes rows between cores and needs <atomic>, so it is
+// built only for ESP32 and Linux host; define PG_ROW_QUEUE as 0 or 1
+// to override
+#ifndef PG_ROW_QUEUE
+#if defined(ESP32) || defined(__linux__)
+#define PG_ROW_QUEUE 1
+#else
+#define PG_ROW_QUEUE 0
+#endif
+#endif
+#if PG_ROW_QUEUE
+#include <atomic>
+// queue positions written by different cores are kept in separate
+// cache lines
+#ifndef PG_CACHE_LINE
+#define PG_CACHE_LINE 64
+#endif
+#endif
+
 typedef enum
 {
 	CONNECTION_OK,
@@ -50,6 +69,7 @@ typedef enum
 								 * backend startup. */
 } ConnStatusType;
 
+#ifndef PG_BUFFER_SIZE
 #ifdef ESP8266
 #define PG_BUFFER_SIZE 2048
 #elif defined(ESP32)
@@ -57,20 +77,75 @@ typedef enum
 #else
 #define PG_BUFFER_SIZE 256
 #endif
+#endif
+
+// size of receive window
+// protocol data is read from Client in chunks of up to this size
+#ifndef PG_RECV_SIZE
+#ifdef ESP8266
+#define PG_RECV_SIZE 256
+#elif defined(ESP32)
+#define PG_RECV_SIZE 1024
+#else
+#define PG_RECV_SIZE 32
+#endif
+#endif
+
+// size of send buffer
+// small messages are collected here and sent with single write
+#ifndef PG_SEND_SIZE
+#ifdef ESP8266
+#define PG_SEND_SIZE 256
+#elif defined(ESP32)
+#define PG_SEND_SIZE 512
+#else
+#define PG_SEND_SIZE 32
+#endif
+#endif
 
-// maximum number of fields in backend response
-// must not exceed number of bits in _formats and _null
+// delay (ms) before PGpool reconnects failed member
+#ifndef PG_POOL_RETRY
+#define PG_POOL_RETRY 1000
+#endif
+
+// maximum number of queries in flight in pipeline mode
+// backend results are not read while sending, so too deep
+// pipeline may stall when socket buffers are full
+#ifndef PG_PIPELINE_DEPTH
+#ifdef __AVR__
+#define PG_PIPELINE_DEPTH 4
+#else
+#define PG_PIPELINE_DEPTH 16
+#endif
+#endif
+// binary format request is kept per query in 32-bit mask
+#if PG_PIPELINE_DEPTH > 32
+#error PG_PIPELINE_DEPTH must not exceed 32
+#endif
+
+// field table at the end of internal buffer keeps 16-bit positions,
+// so only first 32767 bytes of buffer are used; ESP32 keeps full
+// size positions. Define PG_WIDE_FIELDS as 0 or 1 to override
+#ifndef PG_WIDE_FIELDS
 #ifdef ESP32
-#define PG_MAX_FIELDS 64
+#define PG_WIDE_FIELDS 1
 #else
-#define PG_MAX_FIELDS 32
+#define PG_WIDE_FIELDS 0
 #endif
+#endif
+
 // ignore notices and notifications
 #define PG_FLAG_IGNORE_NOTICES 1
 // do not store column names
 #define PG_FLAG_IGNORE_COLUMNS 2
 // never set this flag manually!
 # define PG_FLAG_STATIC_BUFFER 4
+// allow sending queries before previous are finished
+#define PG_FLAG_PIPELINE 8
+// collect outgoing messages until flush() or getData()
+#define PG_FLAG_COALESCE 16
+// keep column types for getType and checked typed getters
+#define PG_FLAG_COLUMN_TYPES 32
 
 // ready for next query
 #define PG_RSTAT_READY 1
@@ -86,15 +161,411 @@ typedef enum
 #define PG_RSTAT_HAVE_ERROR 32
 // notice/notification in buffer
 #define PG_RSTAT_HAVE_NOTICE 64
+// COPY FROM STDIN in progress, send data with copyPut...
+#define PG_RSTAT_COPY_IN 128
+// COPY TO STDOUT in progress, data are passed to copy handler
+#define PG_RSTAT_COPY_OUT 256
+// query finished (pipeline mode), see queryIndex()
+#define PG_RSTAT_QUERY_DONE 512
+// batch of portal rows fetched, more rows available, see fetch()
+#define PG_RSTAT_SUSPENDED 1024
 
 #define PG_RSTAT_HAVE_MASK (PG_RSTAT_HAVE_COLUMNS | \
     PG_RSTAT_HAVE_ROW | \
     PG_RSTAT_HAVE_SUMMARY | \
     PG_RSTAT_HAVE_ERROR | \
-    PG_RSTAT_HAVE_NOTICE)
+    PG_RSTAT_HAVE_NOTICE | \
+    PG_RSTAT_QUERY_DONE | \
+    PG_RSTAT_SUSPENDED)
 
 #define PG_RSTAT_HAVE_MESSAGE (PG_RSTAT_HAVE_ERROR | PG_RSTAT_HAVE_NOTICE)
 
+// type OIDs of built-in types, as returned by getType
+#define PG_OID_BOOL 16
+#define PG_OID_INT8 20
+#define PG_OID_INT2 21
+#define PG_OID_INT4 23
+#define PG_OID_TEXT 25
+#define PG_OID_OID 26
+#define PG_OID_FLOAT4 700
+#define PG_OID_FLOAT8 701
+#define PG_OID_VARCHAR 1043
+#define PG_OID_DATE 1082
+#define PG_OID_TIMESTAMP 1114
+#define PG_OID_TIMESTAMPTZ 1184
+#define PG_OID_NUMERIC 1700
+
+// COPY TO STDOUT handler modes
+// whole lines (without newline)
+#define PG_COPY_LINES 0
+// fields of text format
+#define PG_COPY_TEXT 1
+// fields of CSV format
+#define PG_COPY_CSV 2
+
+/*
+ * COPY TO STDOUT handler
+ * in PG_COPY_LINES mode called once per line with field = -1
+ * in other modes called for each decoded field with field number
+ * (data is NULL for NULL value) and then with field = -1 and
+ * data = NULL at end of row.
+ * data is zero-terminated and valid only during the call
+ */
+typedef void (*PGcopyHandler)(void *ctx, int field, const char *data, int len);
+
+/*
+ * row handler (zero-copy row visitor)
+ * called for every field of row with field number, value and its
+ * length (data is NULL and len is -1 for NULL value), then with
+ * field = -1 at end of row
+ * data is not zero-terminated; if whole row fits in receive window
+ * it points into the window, otherwise into internal buffer.
+ * it is valid only during the call
+ */
+typedef void (*PGrowHandler)(void *ctx, int field, const char *data, int len, int isNull);
+
+/*
+ * chunk handler for values too large for internal buffer
+ * called with consecutive slices of value: data and len describe
+ * slice, offset its position in value, total whole value length.
+ * last slice has offset + len == total.
+ * data is valid only during the call
+ */
+typedef void (*PGchunkHandler)(void *ctx, int field, const char *data, int len,
+        int32_t offset, int32_t total);
+
+// position of column name or value in internal buffer
+// offset is -1 for value passed to chunk handler
+typedef struct {
+#if PG_WIDE_FIELDS
+    int32_t offset;
+    int32_t length;     /* -1 for NULL */
+#else
+    int16_t offset;
+    int16_t length;     /* -1 for NULL, at most 32767 */
+#endif
+} PGfieldPos;
+
+// position of value in PGresult memory
+typedef struct {
+    int offset;
+    int length;     /* -1 for NULL */
+} PGresultPos;
+
+// column type from row description
+typedef struct {
+    uint32_t oid;
+    int32_t typmod;
+    int16_t typlen;     /* -1 for variable length */
+    byte format;        /* 1 for binary */
+} PGfieldType;
+
+/*
+ * compile-time checked query formatting, see executeFormat
+ * PG_FORMAT("...") makes format object from string literal;
+ * format is parsed and checked against argument types by compiler,
+ * at runtime only literal parts are copied and arguments formatted
+ */
+#define PG_FORMAT(s) ([]() { \
+    struct PGformat_ { \
+        static constexpr const char *str() { return s; } \
+        static constexpr int size() { return sizeof(s) - 1; } \
+    }; \
+    return PGformat_(); }())
+
+class PGconnection;
+
+// output of formatter: internal buffer or (if query is too long) connection
+class PGformatter {
+    public:
+        void put(const char *s, int n) {
+            if (!stream && len + n <= room) {
+                memcpy(buf + len, s, n);
+                len += n;
+            }
+            else putSlow(s, n);
+        };
+#ifndef ESP32
+        void put_P(const char *s, int len);
+#endif
+        void putLiteral(const char *s);
+        void putName(const char *s);
+        void putInt(int32_t n);
+        void putInt(int64_t n);
+        void putInt(uint64_t n);
+    private:
+        friend class PGconnection;
+        void putNum(uint32_t u, int neg);
+        void putNum(uint64_t u, int neg);
+        void putSlow(const char *s, int len);
+        PGconnection *conn;
+        char *buf;
+        int32_t room;
+        int32_t len;
+        int32_t total;
+        byte stream;
+        byte err;
+};
+
+// argument kinds: 1 - string, 2 - integer up to 32 bits, 3 - wider integer
+template<class T> struct PGformatArg {
+    enum { kind = 0 };
+};
+template<> struct PGformatArg<const char *> {
+    enum { kind = 1 };
+};
+template<> struct PGformatArg<char *> {
+    enum { kind = 1 };
+};
+#define PG_FORMAT_INT(type, wide) template<> struct PGformatArg<type> { \
+    enum { kind = (wide) ? 3 : 2 }; \
+}
+PG_FORMAT_INT(char, 0);
+PG_FORMAT_INT(signed char, 0);
+PG_FORMAT_INT(unsigned char, 0);
+PG_FORMAT_INT(short, 0);
+PG_FORMAT_INT(unsigned short, sizeof(short) >= 4);
+PG_FORMAT_INT(int, sizeof(int) > 4);
+PG_FORMAT_INT(unsigned int, sizeof(int) >= 4);
+PG_FORMAT_INT(long, sizeof(long) > 4);
+PG_FORMAT_INT(unsigned long, 1);
+PG_FORMAT_INT(long long, 1);
+PG_FORMAT_INT(unsigned long long, 1);
+#undef PG_FORMAT_INT
+
+static inline void pgFormatArg(PGformatter &o, char spec, const char *s)
+{
+    if (spec == 'n') o.putName(s);
+    else o.putLiteral(s);
+}
+
+// plain char buffer must not match integer template below
+static inline void pgFormatArg(PGformatter &o, char spec, char *s)
+{
+    pgFormatArg(o, spec, (const char *)s);
+}
+
+template<class T> static inline void pgFormatArg(PGformatter &o, char, T n)
+{
+    if (PGformatArg<T>::kind != 3) o.putInt((int32_t)n);
+    else if ((T)-1 < (T)0) o.putInt((int64_t)n);
+    else o.putInt((uint64_t)n);
+}
+
+// position of next '%' in s between from and to (or to), recursion depth is log(to - from)
+constexpr int pgFormatFind(const char *s, int from, int to);
+constexpr int pgFormatPick(const char *s, int left, int mid, int to)
+{
+    return left < mid ? left : pgFormatFind(s, mid, to);
+}
+constexpr int pgFormatFind(const char *s, int from, int to)
+{
+    return to - from <= 1 ? ((from < to && s[from] == '%') ? from : to) :
+        pgFormatPick(s, pgFormatFind(s, from, from + (to - from) / 2),
+                from + (to - from) / 2, to);
+}
+
+constexpr bool pgFormatAccepts(char spec, int kind)
+{
+    return (spec == 's' || spec == 'n') ? kind == 1 :
+        (spec == 'd' || spec == 'l') ? (kind == 2 || kind == 3) : false;
+}
+
+template<class... A> struct PGformatCheck;
+template<> struct PGformatCheck<> {
+    static constexpr bool at(const char *s, int n, int pos) {
+        return pos >= n || (s[pos + 1] == '%' && at(s, n, pgFormatFind(s, pos + 2, n)));
+    }
+};
+template<class T, class... A> struct PGformatCheck<T, A...> {
+    static constexpr bool at(const char *s, int n, int pos) {
+        return pos < n && (s[pos + 1] == '%' ?
+            PGformatCheck<T, A...>::at(s, n, pgFormatFind(s, pos + 2, n)) :
+            (pgFormatAccepts(s[pos + 1], PGformatArg<T>::kind) &&
+                PGformatCheck<A...>::at(s, n, pgFormatFind(s, pos + 2, n))));
+    }
+};
+
+// kind: 0 - end of format, 1 - "%%", 2 - argument
+template<class F, int From,
+    int Pos = pgFormatFind(F::str(), From, F::size()),
+    int Kind = (Pos >= F::size()) ? 0 : (F::str()[Pos + 1] == '%') ? 1 : 2>
+struct PGformatEmit;
+
+template<class F, int From, int Pos> struct PGformatEmit<F, From, Pos, 0> {
+    static void emit(PGformatter &o) {
+        o.put(F::str() + From, Pos - From);
+    };
+};
+template<class F, int From, int Pos> struct PGformatEmit<F, From, Pos, 1> {
+    template<class... A> static void emit(PGformatter &o, A... args) {
+        o.put(F::str() + From, Pos - From + 1);
+        PGformatEmit<F, Pos + 2>::emit(o, args...);
+    };
+};
+template<class F, int From, int Pos> struct PGformatEmit<F, From, Pos, 2> {
+    template<class T, class... A> static void emit(PGformatter &o, T arg, A... args) {
+        o.put(F::str() + From, Pos - From);
+        pgFormatArg(o, F::str()[Pos + 1], arg);
+        PGformatEmit<F, Pos + 2>::emit(o, args...);
+    };
+};
+
+/*
+ * connection profile for repeated connections
+ * startup packet is built once, password is kept only
+ * as md5(password || user) if md5 is compiled in, so
+ * plain password needs not stay in RAM and reconnect
+ * doesn't allocate memory.
+ * With md5 compiled in, profile cannot be used with
+ * 'password' authorization.
+ * profile must not be destroyed while connection using it
+ * is being established
+ */
+class PGprofile {
+    public:
+        PGprofile(void);
+        ~PGprofile(void);
+        /*
+         * parameters as in PGconnection::setDbLogin
+         * returns 0 on success or -1 if out of memory
+         */
+        int set(IPAddress server,
+            const char *user,
+            const char *passwd = NULL,
+            const char *db = NULL,
+            const char *charset = NULL,
+            int port = 5432);
+        // frees packet and credential
+        void clear(void);
+    private:
+        friend class PGconnection;
+        IPAddress server;
+        uint16_t port;
+        char *packet;
+        int packetLen;
+        // "md5" + hex hash with md5, password otherwise, NULL if none
+        char *secret;
+};
+
+#if PG_ROW_QUEUE
+/*
+ * lock-free single-producer single-consumer queue of rows,
+ * for passing results between tasks on different cores.
+ * Connection with queue set (see PGconnection::setRowQueue)
+ * copies every received row into the queue instead of returning
+ * it from getData(), so consumer reads rows while next ones are
+ * received. Records are stored in memory given to constructor;
+ * row larger than half of it is skipped and getData() reports
+ * out of memory error.
+ * Producer is the thread calling getData() and putEnd(),
+ * all other methods belong to consumer.
+ */
+class PGrowQueue {
+    public:
+        // memory should be 4-byte aligned
+        PGrowQueue(char *memory, int size);
+        /*
+         * producer: puts end of result mark with given value,
+         * e.g. after PG_RSTAT_READY
+         * returns 1 or 0 if queue is full
+         */
+        int putEnd(int32_t value);
+        /*
+         * consumer: checks next record
+         * returns 0 if queue is empty, 1 for row, 2 for end mark
+         * record is valid until pop()
+         */
+        int peek(void);
+        // removes record returned by peek()
+        void pop(void);
+        /*
+         * access to row returned by peek(), as in PGconnection
+         * getValue returns NULL for NULL value and for values
+         * passed to chunk handler
+         */
+        int nfields(void);
+        char *getValue(int n);
+        int getLength(int n);
+        // value of end mark returned by peek()
+        int32_t endValue(void);
+    private:
+        friend class PGconnection;
+        char *pqReserve(int len);
+        int pqPutRow(const char *data, int len, const PGfieldPos *pos, int nfields);
+        char *ring;
+        uint32_t _size;
+        // producer: reserved record end, last seen tail
+        uint32_t _next;
+        uint32_t _tail;
+        // consumer: current record, last seen head
+        char *_rec;
+        uint32_t _head;
+        // positions on separate cache lines, written by one side each
+        alignas(PG_CACHE_LINE) std::atomic<uint32_t> head;
+        alignas(PG_CACHE_LINE) std::atomic<uint32_t> tail;
+};
+#endif
+
+/*
+ * all rows of one result, packed in single memory block:
+ * values grow from its beginning, table of value positions
+ * (row after row) from its end, so any value is reached
+ * in constant time. Filled by PGconnection::fetchAll.
+ */
+class PGresult {
+    public:
+        /*
+         * memory - size of memory block, allocated once
+         * or given in foreignBuffer; if allocation fails,
+         * no rows are stored (see PGconnection::fetchAll)
+         */
+        PGresult(int memory, char *foreignBuffer = NULL);
+        ~PGresult(void);
+        int nrows(void) {
+            return _nrows;
+        };
+        // zero until first row is stored
+        int nfields(void) {
+            return _nfields;
+        };
+        /*
+         * value in row and column, zero-terminated, or NULL
+         * for NULL value, value passed to chunk handler or
+         * out of range row or column
+         */
+        char *getValue(int row, int col);
+        // length of value or -1 for NULL or out of range
+        int getLength(int row, int col);
+        /*
+         * non-zero if rows were dropped because memory was full
+         */
+        int truncated(void) {
+            return _full;
+        };
+        /*
+         * moves values of every column together, so column
+         * may be scanned without touching other columns
+         * needs free memory of size of stored values
+         * returns 0 or -1 if there is not enough memory
+         */
+        int columnar(void);
+        void clear(void);
+    private:
+        friend class PGconnection;
+        int pqPutRow(const char *data, int len, const PGfieldPos *pos, int nfields);
+        PGresultPos *pqPos(int row, int col) {
+            return _end - (row + 1) * _nfields + col;
+        };
+        char *arena;
+        PGresultPos *_end;
+        int _used;
+        int _nrows;
+        int16_t _nfields;
+        byte _full;
+        byte _own;
+};
+
 class PGconnection {
     public:
         PGconnection(Client *c,
@@ -115,6 +586,10 @@ class PGconnection {
             const char *db = NULL,
             const char *charset = NULL,
             int port = 5432);
+        /*
+         * as above, with data from prepared profile
+         */
+        int setDbLogin(const PGprofile *profile);
         /*
          * performs authorization tasks if needed
          * returns current connection status
@@ -126,6 +601,22 @@ class PGconnection {
          * closes client connection and frees internal buffer
          */
         void close(void);
+        /*
+         * asks backend to cancel query being executed,
+         * using second client c for short connection
+         * to the same server (c must not be connected)
+         * main connection is left intact, results of cancelled
+         * query (usually error) must be fetched as usual
+         * returns 0 if request was sent,
+         * -1 if connection is not established,
+         * -2 if cannot connect, -3 on write error
+         */
+        int cancel(Client *c);
+        /*
+         * sends collected messages (see PG_FLAG_COALESCE)
+         * returns negative value on error or zero on success
+         */
+        int flush(void);
         /*
          * sends query to backend
          * returns negative value on error
@@ -154,6 +645,62 @@ class PGconnection {
          * will be invalidated on next getData call
          */
         char *getValue(int);
+        /*
+         * returns length of n-th column value (or name)
+         * or -1 if value is NULL or column number out of range
+         */
+        int getLength(int n);
+        /*
+         * returns non-zero if n-th column is in binary format
+         */
+        int isBinary(int n);
+        /*
+         * typed access to n-th column value
+         * binary values (int2, int4, int8, oid, bool, float4, float8,
+         * date and timestamp) are decoded by column type, text values
+         * are parsed (bool as 1 or 0)
+         * return zero if value is NULL, not available or binary
+         * value of other type
+         */
+        int32_t getInt32(int n);
+        int64_t getInt64(int n);
+        double getDouble(int n);
+        /*
+         * returns timestamp (or date) as microseconds since 1970-01-01
+         * text values must be in ISO format
+         */
+        int64_t getTimestamp(int n);
+        /*
+         * return type OID, type length and type modifier
+         * of n-th column, valid while columns or rows are
+         * available, or 0 (-1 for length and modifier)
+         * if column number out of range or types are not kept
+         * (see PG_FLAG_COLUMN_TYPES; type OID is also kept
+         * for binary results)
+         */
+        uint32_t getType(int n);
+        int getTypeLength(int n);
+        int32_t getTypeModifier(int n);
+        /*
+         * typed access with type checking
+         * getInt accepts int2 and int4 columns,
+         * getLong also int8,
+         * getFloat float4, float8, numeric (text format only)
+         * and integer types,
+         * getBool only bool,
+         * getTimestampEpoch timestamp, timestamptz and date,
+         * value is seconds since 1970-01-01.
+         * returns zero on success, 1 if value is NULL,
+         * -1 if value is not available or column number out of range,
+         * -2 if column type doesn't match or types are not kept,
+         * -3 if value cannot be parsed or is out of range.
+         * value is set to zero if not successful
+         */
+        int getInt(int n, int32_t *value);
+        int getLong(int n, int64_t *value);
+        int getFloat(int n, float *value);
+        int getBool(int n, int *value);
+        int getTimestampEpoch(int n, int64_t *value);
         /*
          * returns pointer to message (error or notice)
          * if available or NULL
@@ -169,15 +716,45 @@ class PGconnection {
         int ntuples(void) {
             return _ntuples;
         };
+        /*
+         * pipeline mode (PG_FLAG_PIPELINE)
+         * queries are numbered in order of sending, starting from zero
+         * after connection (numbers wrap at 32768)
+         * queryIndex returns number of query current result belongs to
+         * lastQuery returns number of last sent query
+         * inFlight returns number of queries not finished yet
+         */
+        int queryIndex(void) {
+            return _qIndex & 0x7fff;
+        };
+        int lastQuery(void) {
+            return (uint16_t)(_qSent - 1) & 0x7fff;
+        };
+        int inFlight(void) {
+            return (uint16_t)(_qSent - _qDone);
+        };
+        /*
+         * returns number of bytes already read from client
+         * but not decoded yet. For event loops: if neither this
+         * nor number of bytes read from client changed during
+         * getData() or status() call returning zero, connection
+         * waits for data from network
+         */
+        int buffered(void) {
+            return rxLen - rxPos;
+        };
         /*
          * returns length of escaped string
          * single quotes and E prefix (if needed)
          * will be added.
+         * if outbuf is NULL only length is computed,
+         * in the same single pass over inbuf.
          */
         int escapeString(const char *inbuf, char *outbuf);
         /*
          * returns length of escaped string
          * double quotes will be added.
+         * if outbuf is NULL only length is computed.
          */
         int escapeName(const char *inbuf, char *outbuf);
         /*
@@ -192,51 +769,413 @@ class PGconnection {
          * %% - % character
          */
         int executeFormat(int progmem, const char *format, ...);
+        /*
+         * the same with format checked at compile time:
+         * executeFormat(PG_FORMAT("SELECT * FROM %n WHERE id=%d"), table, id)
+         * %d and %l accept any integer type, %s and %n strings.
+         * Format and arguments not matching is compile error.
+         * Query is formatted in single pass if it fits in internal buffer.
+         * Format string is kept in RAM.
+         */
+        template<class F, class... A>
+        auto executeFormat(F, A... args) -> decltype(F::str(), int()) {
+            static_assert(PGformatCheck<A...>::at(F::str(), F::size(),
+                        pgFormatFind(F::str(), 0, F::size())),
+                    "executeFormat: format does not match arguments");
+            PGformatter out;
+            int rc = formatBegin(out);
+            if (rc) return rc;
+            do {
+                PGformatEmit<F, 0>::emit(out, args...);
+            } while ((rc = formatEnd(out)) > 0);
+            return rc;
+        };
+        /*
+         * creates prepared statement using extended query protocol
+         * name may be NULL or empty for unnamed statement
+         * parameters are referred as $1, $2... in query
+         * returns negative value on error
+         * or zero on success
+         * call getData() until PG_RSTAT_READY
+         */
+        int prepare(const char *name, const char *query, int progmem = 0);
+        /*
+         * executes prepared statement
+         * values are sent in text form, without any escaping
+         * NULL pointer in values means NULL value
+         * results are available via getData() as after execute()
+         * if binary is not zero, results are sent in binary format;
+         * from now on type OIDs of result columns are kept,
+         * as binary values are decoded by column type
+         * returns negative value on error
+         * or zero on success
+         */
+        int executePrepared(const char *name, int nparams, const char * const *values,
+                int binary = 0);
+        /*
+         * portal (cursor) support, rows are fetched in batches
+         * with extended query protocol; portal lives in implicit
+         * transaction until closePortal()
+         * openPortal creates unnamed portal for query, fetch()
+         * may be called without waiting for results
+         * fetch requests next batch of at most rows rows (0 - all);
+         * getData() returns them, then PG_RSTAT_SUSPENDED if more rows
+         * are available, or PG_RSTAT_HAVE_SUMMARY when portal is done
+         * closePortal ends portal after summary or error, or
+         * drops remaining rows; call getData() until PG_RSTAT_READY
+         * all return negative value on error or zero on success
+         */
+        int openPortal(const char *query, int progmem = 0);
+        int fetch(int rows);
+        int closePortal(void);
+        /*
+         * COPY ... FROM STDIN support
+         * after query is sent call getData() until PG_RSTAT_COPY_IN
+         * then send data with copyPutData() or copyPutRow()
+         * and finish with copyEnd(). Data are sent in messages
+         * filling whole internal buffer.
+         * all return negative value on error or zero on success
+         */
+        /*
+         * sends raw data in format given in COPY command
+         */
+        int copyPutData(const char *buf, int len);
+        /*
+         * sends one row in text format, values are escaped
+         * NULL pointer in values means NULL value
+         */
+        int copyPutRow(int nfields, const char * const *values);
+        /*
+         * finishes copy, or aborts it if errmsg is not NULL
+         * call getData() until PG_RSTAT_READY
+         */
+        int copyEnd(const char *errmsg = NULL);
+        /*
+         * COPY ... TO STDOUT support
+         * sets handler called from getData() for every row
+         * received in PG_RSTAT_COPY_OUT state (see PGcopyHandler)
+         * rows are not stored, each must fit in internal buffer
+         */
+        /*
+         * sets handler called from getData() for every received row
+         * instead of storing it (see PGrowHandler)
+         * rows are not returned by getData() if handler is set
+         * NULL handler restores normal mode
+         */
+        void setRowHandler(PGrowHandler handler, void *ctx = NULL) {
+            rowHandler = handler;
+            rowCtx = ctx;
+        };
+        /*
+         * collects all rows of current or next result in res
+         * (see PGresult) instead of returning them from getData()
+         * collecting ends with command summary or error; if res
+         * is full, remaining rows are dropped and getData() returns
+         * PG_RSTAT_HAVE_ERROR once. res is cleared.
+         * takes precedence over row handler and queue
+         * returns 0 or -1 if res has no memory (allocation failed),
+         * then first row causes out of memory error as above
+         */
+        int fetchAll(PGresult *res) {
+            _result = res;
+            if (!res) return 0;
+            res->clear();
+            return res->arena ? 0 : -1;
+        };
+#if PG_ROW_QUEUE
+        /*
+         * sets queue receiving copies of rows (see PGrowQueue)
+         * rows are not returned by getData() if queue is set;
+         * while queue is full getData() returns zero and
+         * nothing is read
+         * row handler takes precedence over queue
+         * NULL queue restores normal mode
+         */
+        void setRowQueue(PGrowQueue *queue) {
+            rowQueue = queue;
+        };
+#endif
+        /*
+         * sets handler for row values which don't fit in internal
+         * buffer (see PGchunkHandler). Such values are passed in slices
+         * as they arrive, getValue() returns NULL for them and
+         * getLength() their real length (at most 32767 unless
+         * PG_WIDE_FIELDS is set).
+         * without handler too large value is an error
+         */
+        void setChunkHandler(PGchunkHandler handler, void *ctx = NULL) {
+            chunkHandler = handler;
+            chunkCtx = ctx;
+        };
+        void setCopyHandler(PGcopyHandler handler, void *ctx = NULL,
+                int mode = PG_COPY_LINES) {
+            copyHandler = handler;
+            copyCtx = ctx;
+            copyMode = mode;
+        };
 
 
     private:
         Client *client;
         int pqPacketSend(char pack_type, const char *buf, int buf_len, int progmem = 0);
+        int pqCanSend(void);
+        int pqSendable(void);
+        int pqSend(const char *buf, int len);
+        int pqSend_P(const char *buf, int len);
+        int pqFlush(void);
+        int pqMsgEnd(void);
+        void pqQuerySent(int binary = 0);
+        int pqAvailable(void);
+        int pqFill(void);
+        int pqNeed(int n);
+        int pqGetHeader(void);
         int pqGetc(char *);
         int pqGetInt4(int32_t *result);
         int pqGetInt2(int16_t *result);
         int pqGetnchar(char *s, int len);
         int pqSkipnchar(int len);
-        int pqGets(char *s, int maxlen);
+        int pqGets(int store);
+        int pqSetFieldPos(int types);
+        int pqBufEnd(void) {
+            return _tables ? _tables - Buffer : bufSize;
+        };
+        void pqFreeTables(void) {
+            _fieldType = NULL;
+            _fieldOid = NULL;
+            _tables = NULL;
+        };
+        uint32_t pqOid(int n) {
+            return _fieldType ? _fieldType[n].oid : _fieldOid ? _fieldOid[n] : 0;
+        };
+        int pqCheckType(int n, int classes);
         int pqGetRowDescriptions(void);
         int pqGetRow(void);
+        int pqVisitRow(void);
+        PGrowHandler rowHandler;
+        void *rowCtx;
+#if PG_ROW_QUEUE
+        PGrowQueue *rowQueue;
+#endif
+        PGresult *_result;
+        PGchunkHandler chunkHandler;
+        void *chunkCtx;
         void setMsg(const char *, int);
         void setMsg_P(const char *, int);
         int pqGetNotice(int);
-        int pqGetNotify(int32_t);
+        int pqGetNotify(void);
         char *_user;
         char *_passwd;
+        const PGprofile *_profile;
         char *Buffer;
         int bufSize;
         int bufPos;
+        char rxBuf[PG_RECV_SIZE];
+        int rxPos;
+        int rxLen;
+        char txBuf[PG_SEND_SIZE];
+        int txLen;
+        // state of incremental message decoder
+        char _msgType;
+        int32_t _msgLen;
+        int16_t _step;
+        int16_t _field;
+        int32_t _fieldLen;
+        // length of value passed to chunk handler
+        int32_t _chunkLen;
+        int _bufpos;
         int writeMsgPart(const char *s, int len, int fine);
         int writeMsgPart_P(const char *s, int len, int fine);
-        int32_t writeFormattedQuery(int32_t length, int progmem, const char *format, va_list va);
+        int writeMsgInt(int32_t n, int size);
+        int writeMsgHeader(char type, int32_t len);
+        int copyFlush(void);
+        int pqGetCopyData(void);
+        void copyRow(char *row, int len);
+        PGcopyHandler copyHandler;
+        void *copyCtx;
+        byte copyMode;
+        byte copyQuote;
+        int copyPos;
+        friend class PGformatter;
+        friend class PGbatch;
+        int formatBegin(PGformatter &out);
+        int formatEnd(PGformatter &out);
+        int formatRun(PGformatter &out, int progmem, const char *format, va_list va);
 
         int build_startup_packet(char *packet, const char *db, const char *charset);
         byte conn_status;
         byte attempts;
-/*
+        // cancel request data
+        IPAddress _server;
+        uint16_t _port;
         int32_t be_pid;
         int32_t be_key;
-*/
         int16_t _nfields;
         int16_t _ntuples;
-#ifdef ESP32
-        uint64_t _formats;
-        uint64_t _null;
-#else
-        uint32_t _formats;
-        uint32_t _null;
-#endif
-        byte _binary;
+        // 0 - all fields text, 1 - all binary, 2 - mixed, see _fieldType
+        byte _formats;
+        PGfieldPos *_fieldPos;
+        // column types below _fieldPos, NULL if not kept
+        PGfieldType *_fieldType;
+        // only type OIDs, kept for binary results without column types
+        uint32_t *_fieldOid;
+        // lowest of field tables at end of Buffer, NULL if no result is pending
+        char *_tables;
+        // binary results were requested by query (bit _qSent % 32),
+        // type OIDs are kept for its results
+        uint32_t _binary;
         byte _flags;
         int result_status;
+        // in-flight queries FIFO: sent and finished counters
+        uint16_t _qSent;
+        uint16_t _qDone;
+        uint16_t _qIndex;
+        // portal state, see openPortal
+        byte _portal;
+};
+
+/*
+ * pool of connections to the same database
+ * members are connected in background by poll(), keeping
+ * requested number of idle connections ready (or being
+ * connected), and lost connections are replaced.
+ * at most one connection is started per poll() call, as
+ * connecting may block.
+ */
+class PGpool {
+    public:
+        /*
+         * clients - array of size unconnected clients, one per member
+         * flags and memory are passed to member connections
+         * if arena is not NULL, member i uses
+         * arena + i * memory as its buffer (memory must be > 0)
+         */
+        PGpool(Client **clients,
+                int size,
+                int flags = 0,
+                int memory = 0,
+                char *arena = NULL);
+        ~PGpool(void);
+        /*
+         * sets connection profile (must exist while pool is used)
+         * and number of warm spare connections
+         */
+        void setDbLogin(const PGprofile *profile, int spares = 1);
+        /*
+         * drives connecting members, drains released ones,
+         * replaces lost connections and starts new spares
+         * must be called periodically
+         * returns number of idle ready connections
+         */
+        int poll(void);
+        /*
+         * returns idle ready connection or NULL if none is ready
+         * connection is owned by caller until release()
+         */
+        PGconnection *acquire(void);
+        /*
+         * returns connection to the pool. pending results
+         * of unfinished query are discarded by poll()
+         */
+        void release(PGconnection *conn);
+        // closes all connections
+        void close(void);
+        int size(void) {
+            return _size;
+        };
+    private:
+        typedef struct {
+            PGconnection *conn;
+            Client *client;
+            unsigned long retryAt;
+            byte state;
+        } Member;
+        int pqStart(Member *m);
+        Member *members;
+        const PGprofile *profile;
+        int _size;
+        int spares;
+};
+
+// PGbatch errors
+#define PG_BATCH_NOMEM 1
+#define PG_BATCH_NOCONN 2
+
+/*
+ * multi-row INSERT writer
+ * rows are escaped and appended to single INSERT ... VALUES
+ * statement in own buffer, which is sent when row count, size
+ * or age limit is reached or when next row doesn't fit.
+ * Sent statement results must be consumed with getData()
+ * as usual; statement is sent only when connection may send
+ * next query, so at most one buffer of unsent rows is kept.
+ */
+class PGbatch {
+    public:
+        /*
+         * prefix - statement up to VALUES keyword, e.g.
+         * "INSERT INTO log (t, v) VALUES "
+         * nfields - number of values in row
+         * memory - size of statement buffer, allocated once
+         * or given in foreignBuffer
+         */
+        PGbatch(PGconnection *conn,
+                const char *prefix,
+                int nfields,
+                int memory,
+                char *foreignBuffer = NULL);
+        ~PGbatch(void);
+        /*
+         * statement is sent when it has rows rows, bytes bytes
+         * or when its first row is ms milliseconds old
+         * zero means no limit
+         */
+        void setLimits(int rows, int bytes = 0, unsigned long ms = 0);
+        /*
+         * appends row, values are escaped as with escapeString,
+         * NULL pointer means NULL value
+         * returns 0 if row was added, 1 if buffer is full or limit
+         * is reached and connection is busy (add row again after
+         * getData() returns PG_RSTAT_READY) or negative value on error
+         */
+        int addRow(const char * const *values);
+        /*
+         * sends collected rows, must be called periodically
+         * if time limit is set (poll) or before destroying (flush)
+         * returns 0 if rows were sent or not due, 1 if connection
+         * is busy or negative value on error
+         */
+        int poll(void);
+        int flush(void);
+        // number of collected rows
+        int rows(void) {
+            return _rows;
+        };
+        /*
+         * reason of last error returned by addRow, poll or flush:
+         * PG_BATCH_NOMEM if row doesn't fit in empty buffer (or buffer
+         * was not allocated), PG_BATCH_NOCONN if connection is closed
+         * or broken, zero if error was reported by connection
+         * (see PGconnection::getMessage)
+         */
+        int error(void) {
+            return _err;
+        };
+    private:
+        int pqCheckConn(void);
+        int pqDue(void);
+        PGconnection *conn;
+        char *buffer;
+        int _size;
+        int _prefixLen;
+        int _pos;
+        int _rows;
+        int _nfields;
+        int maxRows;
+        int maxBytes;
+        unsigned long maxAge;
+        unsigned long started;
+        byte _own;
+        byte _err;
 };
 
 #endif
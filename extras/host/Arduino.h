@@ -0,0 +1,74 @@
+/*
+ * Arduino.h - minimal Arduino core shim for building SimplePgSQL on Linux
+ * Copyright (C) Bohdan R. Rau 2016 <ethanak@polip.com>
+ *
+ * SimplePgSQL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * SimplePgSQL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with SimplePgSQL.  If not, write to:
+ * 	The Free Software Foundation, Inc.,
+ * 	51 Franklin Street, Fifth Floor
+ * 	Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Only the parts of the Arduino API used by SimplePgSQL are provided.
+ * Flash memory does not exist here, so all *_P functions work on RAM.
+ */
+
+#ifndef _PG_HOST_ARDUINO_H
+#define _PG_HOST_ARDUINO_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+typedef uint8_t byte;
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const unsigned char *)(addr))
+#define strlen_P strlen
+#define strcpy_P strcpy
+#define strchr_P strchr
+#define memcpy_P memcpy
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+
+class IPAddress {
+    public:
+        IPAddress(void) {
+            addr[0] = addr[1] = addr[2] = addr[3] = 0;
+        };
+        IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+            addr[0] = a;
+            addr[1] = b;
+            addr[2] = c;
+            addr[3] = d;
+        };
+        uint8_t operator [] (int n) const {
+            return addr[n];
+        };
+        uint8_t & operator [] (int n) {
+            return addr[n];
+        };
+    private:
+        uint8_t addr[4];
+};
+
+#endif
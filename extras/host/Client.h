@@ -0,0 +1,60 @@
+/*
+ * Client.h - Arduino Client interface shim for building SimplePgSQL on Linux
+ * Copyright (C) Bohdan R. Rau 2016 <ethanak@polip.com>
+ *
+ * SimplePgSQL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * SimplePgSQL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with SimplePgSQL.  If not, write to:
+ * 	The Free Software Foundation, Inc.,
+ * 	51 Franklin Street, Fifth Floor
+ * 	Boston, MA  02110-1301, USA.
+ */
+#ifndef _PG_HOST_CLIENT_H
+#define _PG_HOST_CLIENT_H 1
+
+#include "Arduino.h"
+
+/*
+ * Same virtual methods as Arduino Client (Print and Stream
+ * methods not used by SimplePgSQL are omitted).
+ * Additionally, vectored write of two buffers is provided;
+ * SimplePgSQL uses it if PG_CLIENT_WRITEV is defined
+ * (not with PG_HOST_NO_WRITEV, to test path used on Arduino).
+ */
+#ifndef PG_HOST_NO_WRITEV
+#define PG_CLIENT_WRITEV 1
+#endif
+
+class Client {
+    public:
+        virtual ~Client() {};
+        virtual int connect(IPAddress ip, uint16_t port) = 0;
+        virtual int connect(const char *host, uint16_t port) = 0;
+        virtual size_t write(uint8_t) = 0;
+        virtual size_t write(const uint8_t *buf, size_t size) = 0;
+        virtual size_t writev(const uint8_t *buf1, size_t size1,
+                const uint8_t *buf2, size_t size2) {
+            size_t n = write(buf1, size1);
+            if (n != size1) return n;
+            return n + write(buf2, size2);
+        };
+        virtual int available() = 0;
+        virtual int read() = 0;
+        virtual int read(uint8_t *buf, size_t size) = 0;
+        virtual int peek() = 0;
+        virtual void flush() = 0;
+        virtual void stop() = 0;
+        virtual uint8_t connected() = 0;
+        virtual operator bool() = 0;
+};
+
+#endif
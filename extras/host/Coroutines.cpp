@@ -0,0 +1,290 @@
+/*
+ * Coroutines.cpp - C++20 coroutine interface to PGconnection
+ * Copyright (C) Bohdan R. Rau 2016 <ethanak@polip.com>
+ *
+ * SimplePgSQL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * SimplePgSQL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with SimplePgSQL.  If not, write to:
+ * 	The Free Software Foundation, Inc.,
+ * 	51 Franklin Street, Fifth Floor
+ * 	Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Coroutines are resumed only from CoScheduler::run(), never from
+ * await_suspend, so every resumed coroutine starts with fresh stack.
+ * Sockets are registered edge-triggered; session stays runnable
+ * until decoder stops making progress, i.e. socket is drained.
+ * Results arriving when no coroutine waits on session (notices)
+ * are decoded when next operation is awaited.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <algorithm>
+#include "Coroutines.h"
+
+#define MAX_EVENTS 64
+
+bool CoAwait::await_suspend(std::coroutine_handle<> h)
+{
+    CoRows *r;
+
+    s->mode = mode;
+    switch (mode) {
+        case CO_CONNECT:
+        s->unwatch();
+        s->skip = 0;
+        s->sql = NULL;
+        s->result = s->pg.setDbLogin((const PGprofile *)arg);
+        if (s->result == CONNECTION_BAD || s->result == CONNECTION_NEEDED) {
+            s->fail();
+            return false;
+        }
+        s->sched.watch(s);
+        break;
+
+        case CO_QUERY:
+        s->failed = false;
+        s->sql = (const char *)arg;
+        if (s->send()) {
+            s->result = -1;
+            return false;
+        }
+        break;
+
+        case CO_ROWS:
+        r = (CoRows *)arg;
+        if (r->done) {
+            s->result = 0;
+            return false;
+        }
+        if (!r->started) {
+            r->started = true;
+            s->failed = false;
+            s->sql = r->sql;
+            if (s->send()) {
+                s->result = 0;
+                return false;
+            }
+        }
+        break;
+    }
+    s->waiter = h;
+    // response may be already waiting in receive window
+    s->runnable = true;
+    return true;
+}
+
+int CoAwait::await_resume()
+{
+    if (mode == CO_ROWS && !s->result) ((CoRows *)arg)->done = true;
+    return s->result;
+}
+
+CoSession::CoSession(CoScheduler &sched, int flags, int memory) :
+    sched(sched), pg(&client, flags, memory), waiter(nullptr),
+    sql(NULL), mode(CO_QUERY), result(0), fd(-1), skip(0), failed(false), runnable(false)
+{
+    sched.sessions.push_back(this);
+}
+
+CoSession::~CoSession()
+{
+    unwatch();
+    pg.close();
+    sched.sessions.erase(std::find(sched.sessions.begin(), sched.sessions.end(), this));
+}
+
+CoRows CoSession::rows(const char *sql)
+{
+    return CoRows(this, sql);
+}
+
+void CoSession::close(void)
+{
+    unwatch();
+    pg.close();
+}
+
+void CoSession::fail(void)
+{
+    const char *msg = pg.getMessage();
+    err = msg ? msg : "unknown error";
+    failed = true;
+}
+
+/*
+ * query waits until results of abandoned CoRows are discarded
+ */
+int CoSession::send(void)
+{
+    if (skip) return 0;
+    if (pg.execute(sql)) {
+        fail();
+        return -1;
+    }
+    sql = NULL;
+    return 0;
+}
+
+void CoSession::unwatch(void)
+{
+    if (fd < 0) return;
+    epoll_ctl(sched.epfd, EPOLL_CTL_DEL, fd, NULL);
+    fd = -1;
+    runnable = false;
+}
+
+CoScheduler::CoScheduler(void)
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+CoScheduler::~CoScheduler()
+{
+    size_t i;
+    // frames own sessions, which unregister themselves
+    for (i = 0; i < tasks.size(); i++) tasks[i].destroy();
+    if (epfd >= 0) ::close(epfd);
+}
+
+void CoScheduler::spawn(CoTask &&task)
+{
+    tasks.push_back(task.h);
+    ready.push_back(task.h);
+    task.h = nullptr;
+}
+
+void CoScheduler::watch(CoSession *s)
+{
+    struct epoll_event ev;
+
+    s->fd = s->client.socket();
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = s;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev) < 0) s->fd = -1;
+}
+
+void CoScheduler::resume(std::coroutine_handle<> h)
+{
+    h.resume();
+    if (h.done()) {
+        tasks.erase(std::find(tasks.begin(), tasks.end(), h));
+        h.destroy();
+    }
+}
+
+/*
+ * returns 1 if waiting coroutine should be resumed
+ */
+int CoScheduler::handle(CoSession *s, int rc)
+{
+    if (rc < 0) {
+        s->fail();
+        s->result = s->mode == CO_QUERY ? -1 : 0;
+        return 1;
+    }
+    // remaining results of abandoned CoRows
+    if (s->skip) {
+        if ((rc & PG_RSTAT_READY) && !--s->skip && s->sql && s->send()) {
+            s->result = s->mode == CO_QUERY ? -1 : 0;
+            return 1;
+        }
+        return 0;
+    }
+    if (rc & PG_RSTAT_HAVE_ERROR) s->fail();
+    if (s->mode == CO_ROWS && (rc & PG_RSTAT_HAVE_ROW)) {
+        s->result = 1;
+        return 1;
+    }
+    if (rc & PG_RSTAT_READY) {
+        s->result = (s->mode == CO_QUERY && s->failed) ? -1 : 0;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * decodes data until result for waiting coroutine is found
+ * and resumes it, or until no progress is made
+ * session may be destroyed by resumed coroutine
+ */
+void CoScheduler::pump(CoSession *s)
+{
+    std::coroutine_handle<> h;
+    uint64_t received;
+    int left, rc;
+
+    for (;;) {
+        received = s->client.bytesReceived();
+        left = s->pg.buffered();
+        if (s->mode == CO_CONNECT) {
+            rc = s->pg.status();
+            if (rc == CONNECTION_OK || rc == CONNECTION_BAD || rc == CONNECTION_NEEDED) {
+                s->result = rc;
+                if (rc != CONNECTION_OK) {
+                    s->fail();
+                    s->unwatch();
+                }
+                break;
+            }
+        }
+        else if ((rc = s->pg.getData()) != 0) {
+            if (handle(s, rc)) break;
+            continue;
+        }
+        if (received == s->client.bytesReceived() && left == s->pg.buffered()) {
+            s->runnable = false;
+            return;
+        }
+    }
+    h = s->waiter;
+    s->waiter = nullptr;
+    resume(h);
+}
+
+int CoScheduler::run(void)
+{
+    struct epoll_event ev[MAX_EVENTS];
+    std::vector<std::coroutine_handle<> > starting;
+    size_t i;
+    bool busy;
+    int n, j;
+
+    if (epfd < 0) return -1;
+    while (!tasks.empty()) {
+        starting.swap(ready);
+        for (i = 0; i < starting.size(); i++) resume(starting[i]);
+        starting.clear();
+        // sessions vector may change while coroutines run
+        busy = false;
+        for (i = 0; i < sessions.size(); i++) {
+            if (sessions[i]->waiter && sessions[i]->runnable) {
+                pump(sessions[i]);
+                busy = true;
+            }
+        }
+        if (busy || !ready.empty()) continue;
+        for (i = 0; i < sessions.size() && !sessions[i]->waiter; i++);
+        // remaining tasks wait for nothing
+        if (i == sessions.size()) return -1;
+        n = epoll_wait(epfd, ev, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        for (j = 0; j < n; j++) ((CoSession *)ev[j].data.ptr)->runnable = true;
+    }
+    return 0;
+}
@@ -0,0 +1,210 @@
+/*
+ * Coroutines.h - C++20 coroutine interface to PGconnection
+ * Copyright (C) Bohdan R. Rau 2016 <ethanak@polip.com>
+ *
+ * SimplePgSQL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * SimplePgSQL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with SimplePgSQL.  If not, write to:
+ * 	The Free Software Foundation, Inc.,
+ * 	51 Franklin Street, Fifth Floor
+ * 	Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Sessions are driven by single-threaded CoScheduler:
+ *
+ *  CoTask worker(CoScheduler &sched, const PGprofile *profile)
+ *  {
+ *      CoSession s(sched);
+ *      if (co_await s.connect(profile) != CONNECTION_OK) co_return;
+ *      co_await s.query("SET search_path TO app");
+ *      CoRows rows = s.rows("SELECT id, name FROM items");
+ *      while (co_await rows.next()) printf("%s\n", rows.value(1));
+ *  }
+ *
+ *  sched.spawn(worker(sched, &profile));
+ *  sched.run();
+ *
+ * Coroutine waiting on session is resumed by scheduler as soon as
+ * result arrives, and row data are valid until next co_await.
+ * Rows left by abandoned CoRows are discarded before results
+ * of next operation. Requires C++20.
+ */
+
+#ifndef _PG_HOST_COROUTINES_H
+#define _PG_HOST_COROUTINES_H 1
+
+#include <coroutine>
+#include <exception>
+#include <string>
+#include <vector>
+#include "SimplePgSQL.h"
+#include "PosixClient.h"
+
+class CoScheduler;
+class CoSession;
+
+// top-level coroutine, started by CoScheduler::spawn
+class CoTask {
+    public:
+        struct promise_type {
+            CoTask get_return_object() {
+                return CoTask(std::coroutine_handle<promise_type>::from_promise(*this));
+            };
+            std::suspend_always initial_suspend() noexcept {
+                return {};
+            };
+            std::suspend_always final_suspend() noexcept {
+                return {};
+            };
+            void return_void() {
+            };
+            void unhandled_exception() {
+                std::terminate();
+            };
+        };
+        CoTask(CoTask &&t) : h(t.h) {
+            t.h = nullptr;
+        };
+        ~CoTask() {
+            if (h) h.destroy();
+        };
+    private:
+        friend class CoScheduler;
+        explicit CoTask(std::coroutine_handle<promise_type> h) : h(h) {
+        };
+        std::coroutine_handle<promise_type> h;
+};
+
+// what coroutine waits for
+enum {
+    CO_CONNECT,
+    CO_QUERY,
+    CO_ROWS
+};
+
+/*
+ * awaitable returned by session operations
+ * result: connection status for connect(),
+ * 0 or -1 on error for query(), 1 for row or 0 at end for next()
+ */
+struct CoAwait {
+    CoSession *s;
+    int mode;
+    const void *arg;
+    bool await_ready() {
+        return false;
+    };
+    bool await_suspend(std::coroutine_handle<> h);
+    int await_resume();
+};
+
+class CoRows;
+
+class CoSession {
+    public:
+        CoSession(CoScheduler &sched, int flags = 0, int memory = 0);
+        ~CoSession();
+        // logs in with profile, returns CONNECTION_OK or CONNECTION_BAD
+        CoAwait connect(const PGprofile *profile) {
+            return CoAwait{this, CO_CONNECT, profile};
+        };
+        // executes query discarding rows, returns 0 or -1 on error
+        CoAwait query(const char *sql) {
+            return CoAwait{this, CO_QUERY, sql};
+        };
+        // executes query, rows are fetched with CoRows::next()
+        CoRows rows(const char *sql);
+        // message of last error
+        const char *error(void) {
+            return err.c_str();
+        };
+        PGconnection &conn(void) {
+            return pg;
+        };
+        void close(void);
+    private:
+        friend class CoScheduler;
+        friend struct CoAwait;
+        friend class CoRows;
+        void unwatch(void);
+        void fail(void);
+        int send(void);
+        CoScheduler &sched;
+        PosixClient client;
+        PGconnection pg;
+        std::coroutine_handle<> waiter;
+        std::string err;
+        const char *sql;
+        int mode;
+        int result;
+        int fd;
+        int skip;
+        bool failed;
+        bool runnable;
+};
+
+/*
+ * rows of single query, query is sent by first next()
+ */
+class CoRows {
+    public:
+        CoRows(const CoRows &) = delete;
+        // rows not fetched are discarded by the session
+        ~CoRows() {
+            if (started && !done) s->skip++;
+        };
+        CoAwait next(void) {
+            return CoAwait{s, CO_ROWS, this};
+        };
+        const char *value(int n) {
+            return s->pg.getValue(n);
+        };
+        // non-zero if query failed, see CoSession::error
+        int failed(void) {
+            return s->failed;
+        };
+    private:
+        friend class CoSession;
+        friend struct CoAwait;
+        CoRows(CoSession *s, const char *sql) : s(s), sql(sql), started(false), done(false) {
+        };
+        CoSession *s;
+        const char *sql;
+        bool started;
+        bool done;
+};
+
+class CoScheduler {
+    public:
+        CoScheduler(void);
+        ~CoScheduler();
+        void spawn(CoTask &&task);
+        /*
+         * runs until all tasks are finished
+         * returns 0 or -1 on error (or if tasks wait for nothing)
+         */
+        int run(void);
+    private:
+        friend class CoSession;
+        friend struct CoAwait;
+        void watch(CoSession *s);
+        void pump(CoSession *s);
+        int handle(CoSession *s, int rc);
+        void resume(std::coroutine_handle<> h);
+        int epfd;
+        std::vector<std::coroutine_handle<> > ready;
+        std::vector<std::coroutine_handle<> > tasks;
+        std::vector<CoSession *> sessions;
+};
+
+#endif
@@ -0,0 +1,158 @@
+/*
+ * EpollDriver.cpp - drives many PGconnections on one thread with epoll
+ * Copyright (C) Bohdan R. Rau 2016 <ethanak@polip.com>
+ *
+ * SimplePgSQL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * SimplePgSQL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with SimplePgSQL.  If not, write to:
+ * 	The Free Software Foundation, Inc.,
+ * 	51 Franklin Street, Fifth Floor
+ * 	Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Sockets are registered level-triggered for input only: library
+ * writes are blocking. Incremental decoder is called only after
+ * socket becomes readable and then until it stops making progress,
+ * i.e. until neither socket nor receive window data were consumed.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <algorithm>
+#include "EpollDriver.h"
+
+#define MAX_EVENTS 64
+
+struct EpollDriver::Entry {
+    PGconnection *conn;
+    PosixClient *client;
+    EpollHandler handler;
+    void *ctx;
+    int fd;
+    bool connecting;
+};
+
+EpollDriver::EpollDriver(void) : count(0), ncalls(0), nidle(0)
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+EpollDriver::~EpollDriver()
+{
+    size_t i;
+    for (i = 0; i < entries.size(); i++) delete entries[i];
+    for (i = 0; i < dead.size(); i++) delete dead[i];
+    if (epfd >= 0) ::close(epfd);
+}
+
+int EpollDriver::add(PGconnection *conn, PosixClient *client,
+        EpollHandler handler, void *ctx)
+{
+    struct epoll_event ev;
+    Entry *e;
+    int rc = conn->status();
+
+    if (epfd < 0 || client->socket() < 0 ||
+            rc == CONNECTION_BAD || rc == CONNECTION_NEEDED) return -1;
+    e = new Entry{conn, client, handler, ctx, client->socket(), rc != CONNECTION_OK};
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = e;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, e->fd, &ev) < 0) {
+        delete e;
+        return -1;
+    }
+    entries.push_back(e);
+    count++;
+    // response may be already waiting in receive window
+    process(e);
+    return 0;
+}
+
+void EpollDriver::drop(Entry *e)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, e->fd, NULL);
+    entries.erase(std::find(entries.begin(), entries.end(), e));
+    // freed after current events are processed
+    e->conn = NULL;
+    dead.push_back(e);
+    count--;
+}
+
+void EpollDriver::remove(PGconnection *conn)
+{
+    size_t i;
+    for (i = 0; i < entries.size(); i++) {
+        if (entries[i]->conn == conn) {
+            drop(entries[i]);
+            return;
+        }
+    }
+}
+
+void EpollDriver::process(Entry *e)
+{
+    PGconnection *conn = e->conn;
+    uint64_t received;
+    int left, rc;
+
+    for (;;) {
+        received = e->client->bytesReceived();
+        left = conn->buffered();
+        ncalls++;
+        if (e->connecting) {
+            rc = conn->status();
+            if (rc == CONNECTION_OK || rc == CONNECTION_BAD || rc == CONNECTION_NEEDED) {
+                e->connecting = false;
+                if (rc != CONNECTION_OK) drop(e);
+                e->handler(e->ctx, conn, 0);
+                if (!e->conn) return;
+                continue;
+            }
+        }
+        else {
+            rc = conn->getData();
+            if (rc) {
+                if (rc < 0 && conn->status() == CONNECTION_BAD) drop(e);
+                e->handler(e->ctx, conn, rc);
+                if (!e->conn) return;
+                continue;
+            }
+        }
+        // no progress, wait for data
+        if (received == e->client->bytesReceived() && left == conn->buffered()) {
+            nidle++;
+            return;
+        }
+    }
+}
+
+int EpollDriver::run(int timeout)
+{
+    struct epoll_event ev[MAX_EVENTS];
+    size_t i;
+    int n, j;
+
+    if (epfd < 0) return -1;
+    n = epoll_wait(epfd, ev, MAX_EVENTS, timeout);
+    if (n < 0) return errno == EINTR ? 0 : -1;
+    for (j = 0; j < n; j++) {
+        Entry *e = (Entry *)ev[j].data.ptr;
+        // dropped by handler of previous event
+        if (!e->conn) continue;
+        process(e);
+    }
+    for (i = 0; i < dead.size(); i++) delete dead[i];
+    dead.clear();
+    return n;
+}
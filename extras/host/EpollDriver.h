@@ -0,0 +1,82 @@
+/*
+ * EpollDriver.h - drives many PGconnections on one thread with epoll
+ * Copyright (C) Bohdan R. Rau 2016 <ethanak@polip.com>
+ *
+ * SimplePgSQL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * SimplePgSQL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with SimplePgSQL.  If not, write to:
+ * 	The Free Software Foundation, Inc.,
+ * 	51 Franklin Street, Fifth Floor
+ * 	Boston, MA  02110-1301, USA.
+ */
+#ifndef _PG_HOST_EPOLLDRIVER_H
+#define _PG_HOST_EPOLLDRIVER_H 1
+
+#include <vector>
+#include "SimplePgSQL.h"
+#include "PosixClient.h"
+
+/*
+ * called for every nonzero getData() result (negative on error),
+ * and with rc = 0 when connection being established reaches
+ * CONNECTION_OK or fails (check conn->status())
+ * handler may send next query, remove or close connection
+ */
+typedef void (*EpollHandler)(void *ctx, PGconnection *conn, int rc);
+
+class EpollDriver {
+    public:
+        EpollDriver(void);
+        ~EpollDriver();
+        /*
+         * registers connection after setDbLogin() or when it is
+         * already connected. client must be the connection's client.
+         * returns 0 or -1 on error
+         */
+        int add(PGconnection *conn, PosixClient *client,
+                EpollHandler handler, void *ctx);
+        /*
+         * unregisters connection, may be called from handler
+         * must be called before connection is closed or destroyed
+         */
+        void remove(PGconnection *conn);
+        /*
+         * waits up to timeout ms (-1 - forever) for socket events
+         * and processes data of ready connections
+         * returns number of processed connections or -1 on error
+         */
+        int run(int timeout);
+        int size(void) {
+            return count;
+        };
+        /*
+         * getData() and status() calls since creation,
+         * and number of them which found no data to decode
+         */
+        uint64_t calls(void) {
+            return ncalls;
+        };
+        uint64_t idleCalls(void) {
+            return nidle;
+        };
+    private:
+        struct Entry;
+        void process(Entry *e);
+        void drop(Entry *e);
+        int epfd;
+        int count;
+        uint64_t ncalls, nidle;
+        std::vector<Entry *> entries;
+        std::vector<Entry *> dead;
+};
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * MD5.h - ArduinoMD5 compatible MD5 for building SimplePgSQL on Linux
+ * Copyright (C) Bohdan R. Rau 2016 <ethanak@polip.com>
+ *
+ * SimplePgSQL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * SimplePgSQL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with SimplePgSQL.  If not, write to:
+ * 	The Free Software Foundation, Inc.,
+ * 	51 Franklin Street, Fifth Floor
+ * 	Boston, MA  02110-1301, USA.
+ */
+#ifndef _PG_HOST_MD5_H
+#define _PG_HOST_MD5_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+    uint32_t lo, hi;
+    uint32_t a, b, c, d;
+    unsigned char buffer[64];
+} MD5_CTX;
+
+/*
+ * Same static interface as https://github.com/tzikis/ArduinoMD5
+ */
+class MD5 {
+    public:
+        static void MD5Init(void *ctx);
+        static void MD5Update(void *ctx, const void *data, size_t size);
+        static void MD5Final(unsigned char *result, void *ctx);
+    private:
+        static const unsigned char *body(MD5_CTX *ctx,
+                const unsigned char *data, size_t size);
+};
+
+#endif
@@ -0,0 +1,1026 @@
+/*
+ * MockBackend.cpp - in-process PostgreSQL v3 protocol mock server
+ * Copyright (C) Bohdan R. Rau 2016 <ethanak@polip.com>
+ *
+ * SimplePgSQL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * SimplePgSQL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with SimplePgSQL.  If not, write to:
+ * 	The Free Software Foundation, Inc.,
+ * 	51 Franklin Street, Fifth Floor
+ * 	Boston, MA  02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <map>
+#include <sstream>
+#include "MD5.h"
+#include "MockBackend.h"
+
+#define OID_BOOL 16
+#define OID_INT8 20
+#define OID_INT2 21
+#define OID_INT4 23
+#define OID_TEXT 25
+#define OID_FLOAT8 701
+#define OID_TIMESTAMP 1114
+
+#define CANCEL_REQUEST_CODE 80877102
+#define PROTOCOL_V3 196608
+
+namespace {
+
+struct Value {
+    bool null;
+    std::string text;
+};
+
+struct Column {
+    std::string name;
+    int32_t oid;
+    int16_t typlen;
+};
+
+enum {
+    PLAN_COMMAND,
+    PLAN_ROWS,
+    PLAN_ERROR,
+    PLAN_EMPTY,
+    PLAN_NOTICE,
+    PLAN_NOTIFY,
+    PLAN_SLEEP,
+    PLAN_COPY_IN,
+    PLAN_COPY_OUT
+};
+
+struct Plan {
+    int kind;
+    std::string tag;
+    std::string message;
+    std::string channel;
+    std::vector<Column> columns;
+    std::vector<std::vector<Value> > rows;
+    int sleep;
+    bool csv;
+};
+
+struct Statement {
+    std::string query;
+};
+
+struct Portal {
+    Plan plan;
+    std::vector<int> formats;
+    size_t cursor;
+    bool started;
+};
+
+class Output {
+    public:
+        void begin(char type) {
+            if (type) buf.push_back(type);
+            start = buf.size();
+            int32(0);
+        };
+        void end(void) {
+            uint32_t len = buf.size() - start;
+            buf[start] = len >> 24;
+            buf[start + 1] = len >> 16;
+            buf[start + 2] = len >> 8;
+            buf[start + 3] = len;
+        };
+        void int8(int v) {
+            buf.push_back((char)v);
+        };
+        void int16(int v) {
+            buf.push_back((char)(v >> 8));
+            buf.push_back((char)v);
+        };
+        void int32(uint32_t v) {
+            buf.push_back((char)(v >> 24));
+            buf.push_back((char)(v >> 16));
+            buf.push_back((char)(v >> 8));
+            buf.push_back((char)v);
+        };
+        void str(const std::string &s) {
+            buf.append(s);
+            buf.push_back(0);
+        };
+        void bytes(const std::string &s) {
+            buf.append(s);
+        };
+        std::string buf;
+        size_t start;
+};
+
+class Input {
+    public:
+        Input(const std::string &s) : buf(s), pos(0) {};
+        int int8(void) {
+            if (pos >= buf.size()) return 0;
+            return (unsigned char)buf[pos++];
+        };
+        int int16(void) {
+            int v = int8() << 8;
+            return (int16_t)(v | int8());
+        };
+        int32_t int32(void) {
+            uint32_t v = (uint32_t)int16() << 16;
+            return (int32_t)(v | (uint16_t)int16());
+        };
+        std::string str(void) {
+            size_t e = buf.find('\0', pos);
+            if (e == std::string::npos) e = buf.size();
+            std::string s = buf.substr(pos, e - pos);
+            pos = e + 1;
+            return s;
+        };
+        std::string bytes(size_t n) {
+            std::string s = buf.substr(pos, n);
+            pos += n;
+            return s;
+        };
+        const std::string &buf;
+        size_t pos;
+};
+
+bool readFull(int fd, void *buf, size_t len)
+{
+    char *c = (char *)buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, c, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        c += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool writeFull(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+int32_t getInt32(const unsigned char *c)
+{
+    return (int32_t)(((uint32_t)c[0] << 24) | ((uint32_t)c[1] << 16) |
+            ((uint32_t)c[2] << 8) | c[3]);
+}
+
+void md5hex(const std::string &s, char *out)
+{
+    MD5_CTX ctx;
+    unsigned char sum[16];
+    MD5::MD5Init(&ctx);
+    MD5::MD5Update(&ctx, s.data(), s.size());
+    MD5::MD5Final(sum, &ctx);
+    for (int i = 0; i < 16; i++) sprintf(out + 2 * i, "%02x", sum[i]);
+}
+
+std::string upperWord(const std::string &q, size_t *after = NULL)
+{
+    size_t i = 0, e;
+    while (i < q.size() && isspace((unsigned char)q[i])) i++;
+    for (e = i; e < q.size() && !isspace((unsigned char)q[e]) && q[e] != ';'; e++);
+    std::string w = q.substr(i, e - i);
+    for (size_t n = 0; n < w.size(); n++) w[n] = toupper((unsigned char)w[n]);
+    if (after) *after = e;
+    return w;
+}
+
+std::string rowValue(int r, int c, int w)
+{
+    std::string s = std::to_string(r) + ":" + std::to_string(c);
+    while ((int)s.size() < w) s.push_back('a' + (r + c + s.size()) % 26);
+    s.resize(w);
+    return s;
+}
+
+void buildRows(Plan &p, const std::string &spec)
+{
+    std::istringstream in(spec);
+    int n = 0, c = 1, w = 8;
+    std::string word, opt;
+    in >> word >> n >> c >> w >> opt;
+    bool nulls = (opt == "nulls" || opt == "NULLS");
+    p.kind = PLAN_ROWS;
+    for (int i = 0; i < c; i++) {
+        p.columns.push_back(Column{"c" + std::to_string(i), OID_TEXT, -1});
+    }
+    p.rows.resize(n);
+    for (int r = 0; r < n; r++) {
+        for (int i = 0; i < c; i++) {
+            if (nulls && (r + i) % 3 == 0) {
+                p.rows[r].push_back(Value{true, ""});
+            }
+            else {
+                p.rows[r].push_back(Value{false, rowValue(r, i, w)});
+            }
+        }
+    }
+    p.tag = "SELECT " + std::to_string(n);
+}
+
+void buildTypes(Plan &p)
+{
+    static const struct {
+        const char *name;
+        int32_t oid;
+        int16_t typlen;
+        const char *value;
+    } types[] = {
+        {"i2", OID_INT2, 2, "12"},
+        {"i4", OID_INT4, 4, "-123456"},
+        {"i8", OID_INT8, 8, "1234567890123"},
+        {"f8", OID_FLOAT8, 8, "3.25"},
+        {"b", OID_BOOL, 1, "t"},
+        {"ts", OID_TIMESTAMP, 8, "2024-01-02 03:04:05.5"},
+        {"txt", OID_TEXT, -1, "hello"},
+        {"nul", OID_INT4, 4, NULL}
+    };
+    p.kind = PLAN_ROWS;
+    p.rows.resize(1);
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        p.columns.push_back(Column{types[i].name, types[i].oid, types[i].typlen});
+        p.rows[0].push_back(Value{!types[i].value,
+                types[i].value ? types[i].value : ""});
+    }
+    p.tag = "SELECT 1";
+}
+
+std::string csvEscape(const std::string &s)
+{
+    if (s.find_first_of(",\"\n\r") == std::string::npos && !s.empty()) return s;
+    std::string o = "\"";
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '"') o.push_back('"');
+        o.push_back(s[i]);
+    }
+    return o + "\"";
+}
+
+std::string copyEscape(const std::string &s)
+{
+    std::string o;
+    for (size_t i = 0; i < s.size(); i++) {
+        switch (s[i]) {
+            case '\t': o += "\\t"; break;
+            case '\n': o += "\\n"; break;
+            case '\\': o += "\\\\"; break;
+            default: o.push_back(s[i]);
+        }
+    }
+    return o;
+}
+
+Plan plan(const std::string &q)
+{
+    Plan p;
+    size_t after;
+    std::string w = upperWord(q, &after);
+    p.kind = PLAN_COMMAND;
+    p.sleep = 0;
+    p.csv = false;
+    if (w.empty()) {
+        p.kind = PLAN_EMPTY;
+        return p;
+    }
+    if (w == "ROWS") {
+        buildRows(p, q);
+        return p;
+    }
+    if (w == "TYPES") {
+        buildTypes(p);
+        return p;
+    }
+    if (w == "ERROR") {
+        p.kind = PLAN_ERROR;
+        p.message = "mock error";
+        return p;
+    }
+    if (w == "NOTICE") {
+        p.kind = PLAN_NOTICE;
+        p.tag = "DO";
+        return p;
+    }
+    if (w == "NOTIFY") {
+        std::istringstream in(q.substr(after));
+        p.kind = PLAN_NOTIFY;
+        in >> p.channel;
+        std::getline(in >> std::ws, p.message);
+        p.tag = "NOTIFY";
+        return p;
+    }
+    if (w == "SLEEP") {
+        p.kind = PLAN_SLEEP;
+        p.sleep = atoi(q.c_str() + after);
+        p.tag = "SELECT 1";
+        return p;
+    }
+    if (w == "INSERT") {
+        size_t v = q.find("VALUES");
+        int n = 1;
+        if (v != std::string::npos) {
+            int depth = 0;
+            bool quoted = false;
+            n = 0;
+            for (size_t i = v; i < q.size(); i++) {
+                if (q[i] == '\'') quoted = !quoted;
+                if (quoted) continue;
+                if (q[i] == '(' && !depth++) n++;
+                else if (q[i] == ')') depth--;
+            }
+        }
+        p.tag = "INSERT 0 " + std::to_string(n);
+        return p;
+    }
+    if (w == "COPY") {
+        if (q.find("FROM STDIN") != std::string::npos) {
+            p.kind = PLAN_COPY_IN;
+            return p;
+        }
+        size_t r = q.find("ROWS");
+        if (r != std::string::npos) {
+            buildRows(p, q.substr(r));
+        }
+        else {
+            static const char *fixed[][3] = {
+                {"1", "one", "first line"},
+                {"2", NULL, "with\ttab"},
+                {"3", "three", "back\\slash"},
+                {"4", "", "say \"hi\",\nbye"}
+            };
+            p.rows.resize(4);
+            for (int i = 0; i < 4; i++) {
+                for (int j = 0; j < 3; j++) {
+                    p.rows[i].push_back(Value{!fixed[i][j],
+                            fixed[i][j] ? fixed[i][j] : ""});
+                }
+            }
+        }
+        p.kind = PLAN_COPY_OUT;
+        p.csv = q.find("CSV") != std::string::npos;
+        p.tag = "COPY " + std::to_string(p.rows.size());
+        return p;
+    }
+    p.tag = w;
+    return p;
+}
+
+std::string substitute(const std::string &q, const std::vector<Value> &params)
+{
+    std::string o;
+    for (size_t i = 0; i < q.size(); i++) {
+        if (q[i] == '$' && i + 1 < q.size() && isdigit((unsigned char)q[i + 1])) {
+            size_t n = 0;
+            while (i + 1 < q.size() && isdigit((unsigned char)q[i + 1])) {
+                n = n * 10 + q[++i] - '0';
+            }
+            if (n >= 1 && n <= params.size()) {
+                o += params[n - 1].null ? "NULL" : params[n - 1].text;
+            }
+            continue;
+        }
+        o.push_back(q[i]);
+    }
+    return o;
+}
+
+int64_t daysFromCivil(int y, int m, int d)
+{
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+std::string binaryValue(const Column &col, const std::string &text)
+{
+    Output o;
+    switch (col.oid) {
+        case OID_INT2:
+        o.int16(atoi(text.c_str()));
+        break;
+
+        case OID_INT4:
+        o.int32(atoi(text.c_str()));
+        break;
+
+        case OID_INT8:
+        {
+            uint64_t v = strtoll(text.c_str(), NULL, 10);
+            o.int32(v >> 32);
+            o.int32((uint32_t)v);
+        }
+        break;
+
+        case OID_FLOAT8:
+        {
+            double d = strtod(text.c_str(), NULL);
+            uint64_t v;
+            memcpy(&v, &d, 8);
+            o.int32(v >> 32);
+            o.int32((uint32_t)v);
+        }
+        break;
+
+        case OID_BOOL:
+        o.int8(text == "t");
+        break;
+
+        case OID_TIMESTAMP:
+        {
+            int y, m, d, hh, mm;
+            double ss;
+            sscanf(text.c_str(), "%d-%d-%d %d:%d:%lf", &y, &m, &d, &hh, &mm, &ss);
+            int64_t us = (daysFromCivil(y, m, d) - daysFromCivil(2000, 1, 1)) * 86400000000LL +
+                (hh * 3600LL + mm * 60LL) * 1000000LL + (int64_t)(ss * 1000000 + 0.5);
+            o.int32((uint64_t)us >> 32);
+            o.int32((uint32_t)us);
+        }
+        break;
+
+        default:
+        o.bytes(text);
+    }
+    return o.buf;
+}
+
+}
+
+struct MockBackend::Session {
+    int fd;
+    int32_t pid;
+    int32_t key;
+    std::atomic<bool> cancel;
+    Output out;
+    std::map<std::string, Statement> statements;
+    std::map<std::string, Portal> portals;
+    bool failed;
+};
+
+MockBackend::MockBackend(const char *u, const char *p, int a) :
+    user(u), passwd(p ? p : ""), auth(a), listenFd(-1), _port(0),
+    segSize(0), segDelay(0), running(false),
+    nqueries(0), nconnections(0), ncancels(0), nextPid(1000)
+{
+}
+
+MockBackend::~MockBackend()
+{
+    stop();
+}
+
+int MockBackend::start(int port)
+{
+    struct sockaddr_in sa;
+    socklen_t salen = sizeof(sa);
+    int one = 1;
+
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd < 0) return -1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenFd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+            listen(listenFd, 512) < 0 ||
+            getsockname(listenFd, (struct sockaddr *)&sa, &salen) < 0) {
+        close(listenFd);
+        listenFd = -1;
+        return -1;
+    }
+    _port = ntohs(sa.sin_port);
+    running = true;
+    acceptor = std::thread(&MockBackend::acceptLoop, this);
+    return _port;
+}
+
+void MockBackend::stop(void)
+{
+    if (!running) return;
+    running = false;
+    shutdown(listenFd, SHUT_RDWR);
+    close(listenFd);
+    acceptor.join();
+    {
+        std::lock_guard<std::mutex> g(lock);
+        for (size_t i = 0; i < sessions.size(); i++) {
+            shutdown(sessions[i]->fd, SHUT_RDWR);
+        }
+    }
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+    workers.clear();
+}
+
+std::string MockBackend::lastCopy(void)
+{
+    std::lock_guard<std::mutex> g(lock);
+    return _lastCopy;
+}
+
+std::string MockBackend::lastQuery(void)
+{
+    std::lock_guard<std::mutex> g(lock);
+    return _lastQuery;
+}
+
+void MockBackend::acceptLoop(void)
+{
+    while (running) {
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        std::lock_guard<std::mutex> g(lock);
+        workers.push_back(std::thread(&MockBackend::serve, this, fd));
+    }
+}
+
+static void sendError(Output &out, const char *code, const std::string &msg)
+{
+    out.begin('E');
+    out.int8('S');
+    out.str("ERROR");
+    out.int8('C');
+    out.str(code);
+    out.int8('M');
+    out.str(msg);
+    out.int8(0);
+    out.end();
+}
+
+static void sendDescription(Output &out, const Plan &p, const std::vector<int> &formats)
+{
+    if (p.kind != PLAN_ROWS) {
+        out.begin('n');
+        out.end();
+        return;
+    }
+    out.begin('T');
+    out.int16(p.columns.size());
+    for (size_t i = 0; i < p.columns.size(); i++) {
+        out.str(p.columns[i].name);
+        out.int32(0);
+        out.int16(i + 1);
+        out.int32(p.columns[i].oid);
+        out.int16(p.columns[i].typlen);
+        out.int32(-1);
+        out.int16(formats.empty() ? 0 :
+                formats.size() == 1 ? formats[0] : formats[i]);
+    }
+    out.end();
+}
+
+static void sendRow(Output &out, const Plan &p, const std::vector<Value> &row,
+        const std::vector<int> &formats)
+{
+    out.begin('D');
+    out.int16(row.size());
+    for (size_t i = 0; i < row.size(); i++) {
+        if (row[i].null) {
+            out.int32(-1);
+            continue;
+        }
+        int fmt = formats.empty() ? 0 :
+            formats.size() == 1 ? formats[0] : formats[i];
+        std::string v = fmt ? binaryValue(p.columns[i], row[i].text) : row[i].text;
+        out.int32(v.size());
+        out.bytes(v);
+    }
+    out.end();
+}
+
+void MockBackend::serve(int fd)
+{
+    Session s;
+    unsigned char hdr[8];
+    std::string body;
+    int32_t len;
+
+    s.fd = fd;
+    s.cancel = false;
+    s.failed = false;
+    if (!readFull(fd, hdr, 8)) goto done;
+    len = getInt32(hdr);
+    if (len < 8 || len > 10000) goto done;
+    body.resize(len - 8);
+    if (!readFull(fd, &body[0], len - 8)) goto done;
+    if (getInt32(hdr + 4) == CANCEL_REQUEST_CODE) {
+        Input in(body);
+        int32_t pid = in.int32();
+        int32_t key = in.int32();
+        std::lock_guard<std::mutex> g(lock);
+        for (size_t i = 0; i < sessions.size(); i++) {
+            if (sessions[i]->pid == pid && sessions[i]->key == key) {
+                sessions[i]->cancel = true;
+                ncancels++;
+            }
+        }
+        goto done;
+    }
+    if (getInt32(hdr + 4) != PROTOCOL_V3) goto done;
+    {
+        Input in(body);
+        std::string u;
+        for (;;) {
+            std::string k = in.str();
+            if (k.empty()) break;
+            std::string v = in.str();
+            if (k == "user") u = v;
+        }
+        if (u != user) {
+            sendError(s.out, "28000", "role \"" + u + "\" does not exist");
+            writeFull(fd, s.out.buf.data(), s.out.buf.size());
+            goto done;
+        }
+    }
+    if (auth != AUTH_TRUST) {
+        char salt[4] = {'s', 'a', 'l', 't'};
+        char expect[36];
+        char type;
+        s.out.begin('R');
+        s.out.int32(auth == AUTH_MD5 ? 5 : 3);
+        if (auth == AUTH_MD5) s.out.bytes(std::string(salt, 4));
+        s.out.end();
+        writeFull(fd, s.out.buf.data(), s.out.buf.size());
+        s.out.buf.clear();
+        if (!readFull(fd, &type, 1) || type != 'p' || !readFull(fd, hdr, 4)) goto done;
+        len = getInt32(hdr) - 4;
+        if (len < 1 || len > 1000) goto done;
+        body.resize(len);
+        if (!readFull(fd, &body[0], len)) goto done;
+        body.resize(strlen(body.c_str()));
+        if (auth == AUTH_MD5) {
+            strcpy(expect, "md5");
+            md5hex(passwd + user, expect + 3);
+            md5hex(std::string(expect + 3) + std::string(salt, 4), expect + 3);
+        }
+        else {
+            strcpy(expect, passwd.c_str());
+        }
+        if (body != expect) {
+            sendError(s.out, "28P01", "password authentication failed for user \"" + user + "\"");
+            writeFull(fd, s.out.buf.data(), s.out.buf.size());
+            goto done;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> g(lock);
+        s.pid = nextPid++;
+        s.key = s.pid * 7919;
+        sessions.push_back(&s);
+    }
+    nconnections++;
+    s.out.begin('R');
+    s.out.int32(0);
+    s.out.end();
+    s.out.begin('S');
+    s.out.str("server_version");
+    s.out.str("9.6.0");
+    s.out.end();
+    s.out.begin('S');
+    s.out.str("client_encoding");
+    s.out.str("UTF8");
+    s.out.end();
+    s.out.begin('K');
+    s.out.int32(s.pid);
+    s.out.int32(s.key);
+    s.out.end();
+    s.out.begin('Z');
+    s.out.int8('I');
+    s.out.end();
+
+    for (;;) {
+        char type;
+        if (!s.out.buf.empty()) {
+            const char *c = s.out.buf.data();
+            size_t left = s.out.buf.size();
+            while (left > 0) {
+                size_t n = left;
+                if (segSize > 0 && n > (size_t)segSize) n = segSize;
+                if (!writeFull(fd, c, n)) goto unregister;
+                c += n;
+                left -= n;
+                if (left && segDelay > 0) usleep(segDelay);
+            }
+            s.out.buf.clear();
+        }
+        if (!readFull(fd, &type, 1) || !readFull(fd, hdr, 4)) break;
+        len = getInt32(hdr) - 4;
+        if (len < 0) break;
+        body.resize(len);
+        if (len && !readFull(fd, &body[0], len)) break;
+        Input in(body);
+        if (type == 'X') break;
+        if (s.failed && type != 'S') continue;
+
+        switch (type) {
+            case 'Q':
+            {
+                std::string q = in.str();
+                {
+                    std::lock_guard<std::mutex> g(lock);
+                    _lastQuery = q;
+                }
+                nqueries++;
+                s.cancel = false;
+                Plan p = plan(q);
+                std::vector<int> noformats;
+                switch (p.kind) {
+                    case PLAN_EMPTY:
+                    s.out.begin('I');
+                    s.out.end();
+                    break;
+
+                    case PLAN_ERROR:
+                    sendError(s.out, "XX000", p.message);
+                    break;
+
+                    case PLAN_NOTICE:
+                    s.out.begin('N');
+                    s.out.int8('S');
+                    s.out.str("NOTICE");
+                    s.out.int8('M');
+                    s.out.str("mock notice");
+                    s.out.int8(0);
+                    s.out.end();
+                    break;
+
+                    case PLAN_NOTIFY:
+                    s.out.begin('A');
+                    s.out.int32(s.pid);
+                    s.out.str(p.channel);
+                    s.out.str(p.message);
+                    s.out.end();
+                    break;
+
+                    case PLAN_SLEEP:
+                    for (int t = 0; t < p.sleep && !s.cancel; t += 5) usleep(5000);
+                    if (s.cancel) {
+                        sendError(s.out, "57014", "canceling statement due to user request");
+                        p.kind = PLAN_ERROR;
+                    }
+                    break;
+
+                    case PLAN_ROWS:
+                    sendDescription(s.out, p, noformats);
+                    for (size_t r = 0; r < p.rows.size(); r++) {
+                        sendRow(s.out, p, p.rows[r], noformats);
+                        if (s.out.buf.size() > 65536) {
+                            if (!writeFull(fd, s.out.buf.data(), s.out.buf.size())) goto unregister;
+                            s.out.buf.clear();
+                        }
+                    }
+                    break;
+
+                    case PLAN_COPY_IN:
+                    {
+                        std::string data;
+                        bool failed = false;
+                        s.out.begin('G');
+                        s.out.int8(0);
+                        s.out.int16(0);
+                        s.out.end();
+                        writeFull(fd, s.out.buf.data(), s.out.buf.size());
+                        s.out.buf.clear();
+                        for (;;) {
+                            if (!readFull(fd, &type, 1) || !readFull(fd, hdr, 4)) goto unregister;
+                            len = getInt32(hdr) - 4;
+                            body.resize(len);
+                            if (len && !readFull(fd, &body[0], len)) goto unregister;
+                            if (type == 'd') data += body;
+                            else if (type == 'c') break;
+                            else if (type == 'f') {
+                                failed = true;
+                                break;
+                            }
+                        }
+                        {
+                            std::lock_guard<std::mutex> g(lock);
+                            _lastCopy = data;
+                        }
+                        if (failed) {
+                            sendError(s.out, "57014", "COPY from stdin failed: " +
+                                    std::string(body.c_str()));
+                            p.kind = PLAN_ERROR;
+                        }
+                        else {
+                            size_t n = 0;
+                            for (size_t i = 0; i < data.size(); i++) n += data[i] == '\n';
+                            p.tag = "COPY " + std::to_string(n);
+                        }
+                    }
+                    break;
+
+                    case PLAN_COPY_OUT:
+                    s.out.begin('H');
+                    s.out.int8(0);
+                    s.out.int16(p.rows.empty() ? 0 : p.rows[0].size());
+                    for (size_t i = 0; !p.rows.empty() && i < p.rows[0].size(); i++) {
+                        s.out.int16(0);
+                    }
+                    s.out.end();
+                    for (size_t r = 0; r < p.rows.size(); r++) {
+                        std::string line;
+                        for (size_t i = 0; i < p.rows[r].size(); i++) {
+                            if (p.csv) {
+                                if (i) line.push_back(',');
+                                if (!p.rows[r][i].null) line += csvEscape(p.rows[r][i].text);
+                                continue;
+                            }
+                            if (i) line.push_back('\t');
+                            line += p.rows[r][i].null ? "\\N" : copyEscape(p.rows[r][i].text);
+                        }
+                        line.push_back('\n');
+                        s.out.begin('d');
+                        s.out.bytes(line);
+                        s.out.end();
+                    }
+                    s.out.begin('c');
+                    s.out.end();
+                    break;
+                }
+                if (p.kind != PLAN_ERROR && p.kind != PLAN_EMPTY) {
+                    s.out.begin('C');
+                    s.out.str(p.tag);
+                    s.out.end();
+                }
+                s.out.begin('Z');
+                s.out.int8('I');
+                s.out.end();
+            }
+            break;
+
+            case 'P':
+            {
+                std::string name = in.str();
+                s.statements[name].query = in.str();
+                s.out.begin('1');
+                s.out.end();
+            }
+            break;
+
+            case 'B':
+            {
+                std::string portal = in.str();
+                std::string stmt = in.str();
+                std::vector<int> pformats;
+                std::vector<Value> params;
+                int n = in.int16();
+                for (int i = 0; i < n; i++) pformats.push_back(in.int16());
+                n = in.int16();
+                for (int i = 0; i < n; i++) {
+                    int32_t l = in.int32();
+                    if (l < 0) params.push_back(Value{true, ""});
+                    else params.push_back(Value{false, in.bytes(l)});
+                }
+                if (!s.statements.count(stmt)) {
+                    sendError(s.out, "26000",
+                            "prepared statement \"" + stmt + "\" does not exist");
+                    s.failed = true;
+                    break;
+                }
+                Portal &p = s.portals[portal];
+                std::string q = substitute(s.statements[stmt].query, params);
+                {
+                    std::lock_guard<std::mutex> g(lock);
+                    _lastQuery = q;
+                }
+                p.plan = plan(q);
+                p.formats.clear();
+                n = in.int16();
+                for (int i = 0; i < n; i++) p.formats.push_back(in.int16());
+                p.cursor = 0;
+                p.started = false;
+                s.out.begin('2');
+                s.out.end();
+            }
+            break;
+
+            case 'D':
+            {
+                int what = in.int8();
+                std::string name = in.str();
+                if (what == 'S') {
+                    s.out.begin('t');
+                    s.out.int16(0);
+                    s.out.end();
+                    s.out.begin('n');
+                    s.out.end();
+                }
+                else if (s.portals.count(name)) {
+                    sendDescription(s.out, s.portals[name].plan, s.portals[name].formats);
+                }
+                else {
+                    sendError(s.out, "34000", "portal \"" + name + "\" does not exist");
+                    s.failed = true;
+                }
+            }
+            break;
+
+            case 'E':
+            {
+                std::string name = in.str();
+                int32_t limit = in.int32();
+                if (!s.portals.count(name)) {
+                    sendError(s.out, "34000", "portal \"" + name + "\" does not exist");
+                    s.failed = true;
+                    break;
+                }
+                Portal &p = s.portals[name];
+                if (!p.started) {
+                    nqueries++;
+                    p.started = true;
+                }
+                if (p.plan.kind == PLAN_ERROR) {
+                    sendError(s.out, "XX000", p.plan.message);
+                    s.failed = true;
+                    break;
+                }
+                if (p.plan.kind == PLAN_ROWS) {
+                    size_t n = 0;
+                    while (p.cursor < p.plan.rows.size() && (limit <= 0 || (int32_t)n < limit)) {
+                        sendRow(s.out, p.plan, p.plan.rows[p.cursor++], p.formats);
+                        n++;
+                    }
+                    if (p.cursor < p.plan.rows.size()) {
+                        s.out.begin('s');
+                        s.out.end();
+                        break;
+                    }
+                }
+                s.out.begin('C');
+                s.out.str(p.plan.tag);
+                s.out.end();
+            }
+            break;
+
+            case 'C':
+            {
+                int what = in.int8();
+                std::string name = in.str();
+                if (what == 'S') s.statements.erase(name);
+                else s.portals.erase(name);
+                s.out.begin('3');
+                s.out.end();
+            }
+            break;
+
+            case 'H':
+            break;
+
+            case 'S':
+            s.failed = false;
+            s.portals.erase("");
+            s.out.begin('Z');
+            s.out.int8('I');
+            s.out.end();
+            break;
+
+            default:
+            sendError(s.out, "08P01", "invalid frontend message type");
+            s.failed = true;
+        }
+    }
+unregister:
+    {
+        std::lock_guard<std::mutex> g(lock);
+        for (size_t i = 0; i < sessions.size(); i++) {
+            if (sessions[i] == &s) {
+                sessions.erase(sessions.begin() + i);
+                break;
+            }
+        }
+    }
+done:
+    close(fd);
+}
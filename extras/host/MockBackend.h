@@ -0,0 +1,118 @@
+/*
+ * MockBackend.h - in-process PostgreSQL v3 protocol mock server
+ * Copyright (C) Bohdan R. Rau 2016 <ethanak@polip.com>
+ *
+ * SimplePgSQL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * SimplePgSQL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with SimplePgSQL.  If not, write to:
+ * 	The Free Software Foundation, Inc.,
+ * 	51 Franklin Street, Fifth Floor
+ * 	Boston, MA  02110-1301, USA.
+ */
+#ifndef _PG_HOST_MOCKBACKEND_H
+#define _PG_HOST_MOCKBACKEND_H 1
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Mock backend listens on 127.0.0.1 and serves every accepted
+ * connection in its own thread. It knows nothing about SQL;
+ * queries are recognized by their first word:
+ *
+ * ROWS n c w [nulls] - n rows of c text columns, w bytes each
+ *                      (with "nulls" every third value is NULL)
+ * TYPES              - one row of int2, int4, int8, float8, bool,
+ *                      timestamp and text columns
+ * INSERT ...         - "INSERT 0 k", k is number of VALUES tuples
+ * ERROR              - ErrorResponse
+ * NOTICE             - NoticeResponse followed by "DO"
+ * NOTIFY chan [msg]  - NotificationResponse followed by "NOTIFY"
+ * SLEEP ms           - waits, may be interrupted by CancelRequest
+ * COPY ... FROM STDIN
+ * COPY ... TO STDOUT - rows of "ROWS" specification if present
+ *                      in query, four fixed rows otherwise
+ *                      (CSV format if query contains "CSV")
+ * anything else      - CommandComplete with first word as tag
+ *
+ * Extended protocol parameters are substituted textually for $n.
+ */
+
+class MockBackend {
+    public:
+        enum {
+            AUTH_TRUST,
+            AUTH_PASSWORD,
+            AUTH_MD5
+        };
+        MockBackend(const char *user = "user",
+                const char *passwd = "secret",
+                int auth = AUTH_MD5);
+        ~MockBackend();
+        /*
+         * starts listening thread
+         * returns port number or negative value on error
+         */
+        int start(int port = 0);
+        void stop(void);
+        int port(void) {
+            return _port;
+        };
+        /*
+         * splits every response into segments of given size,
+         * sleeping usec microseconds between them
+         */
+        void setSegments(int size, int usec) {
+            segSize = size;
+            segDelay = usec;
+        };
+        /*
+         * data received by last COPY FROM STDIN
+         */
+        std::string lastCopy(void);
+        /*
+         * text of last query (simple or extended)
+         */
+        std::string lastQuery(void);
+        int queries(void) {
+            return nqueries;
+        };
+        int connections(void) {
+            return nconnections;
+        };
+        int cancels(void) {
+            return ncancels;
+        };
+
+    private:
+        struct Session;
+        void acceptLoop(void);
+        void serve(int fd);
+        std::string user, passwd;
+        int auth;
+        int listenFd;
+        int _port;
+        std::atomic<int> segSize, segDelay;
+        std::atomic<bool> running;
+        std::atomic<int> nqueries, nconnections, ncancels;
+        std::thread acceptor;
+        std::mutex lock;
+        std::vector<std::thread> workers;
+        std::vector<Session *> sessions;
+        std::string _lastCopy, _lastQuery;
+        int nextPid;
+};
+
+#endif
@@ -0,0 +1,209 @@
+/*
+ * PosixClient.cpp - Arduino Client over POSIX TCP sockets
+ * Copyright (C) Bohdan R. Rau 2016 <ethanak@polip.com>
+ *
+ * SimplePgSQL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * SimplePgSQL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with SimplePgSQL.  If not, write to:
+ * 	The Free Software Foundation, Inc.,
+ * 	51 Franklin Street, Fifth Floor
+ * 	Boston, MA  02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "PosixClient.h"
+
+PosixClient::PosixClient(void)
+{
+    fd = -1;
+    eof = 0;
+    rxBytes = txBytes = rxCalls = txCalls = 0;
+}
+
+PosixClient::~PosixClient()
+{
+    stop();
+}
+
+static int setup_socket(int fd)
+{
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+int PosixClient::connect(IPAddress ip, uint16_t port)
+{
+    struct sockaddr_in sa;
+
+    stop();
+    fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return 0;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(((uint32_t)ip[0] << 24) | ((uint32_t)ip[1] << 16) |
+            ((uint32_t)ip[2] << 8) | ip[3]);
+    if (::connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+            setup_socket(fd) < 0) {
+        stop();
+        return 0;
+    }
+    eof = 0;
+    return 1;
+}
+
+int PosixClient::connect(const char *host, uint16_t port)
+{
+    struct addrinfo hints, *res, *ai;
+    char service[8];
+
+    stop();
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%u", port);
+    if (getaddrinfo(host, service, &hints, &res)) return 0;
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (!::connect(fd, ai->ai_addr, ai->ai_addrlen) && !setup_socket(fd)) break;
+        ::close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    eof = 0;
+    return fd >= 0;
+}
+
+size_t PosixClient::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+size_t PosixClient::write(const uint8_t *buf, size_t size)
+{
+    size_t done = 0;
+    ssize_t n;
+    if (fd < 0) return 0;
+    txCalls++;
+    // the socket is non-blocking, but Arduino clients block on write
+    while (done < size) {
+        n = ::send(fd, buf + done, size - done, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                fd_set wfds;
+                FD_ZERO(&wfds);
+                FD_SET(fd, &wfds);
+                select(fd + 1, NULL, &wfds, NULL, NULL);
+                continue;
+            }
+            return done;
+        }
+        done += n;
+    }
+    txBytes += done;
+    return done;
+}
+
+size_t PosixClient::writev(const uint8_t *buf1, size_t size1,
+        const uint8_t *buf2, size_t size2)
+{
+    struct iovec iov[2];
+    ssize_t n;
+    if (fd < 0) return 0;
+    iov[0].iov_base = (void *)buf1;
+    iov[0].iov_len = size1;
+    iov[1].iov_base = (void *)buf2;
+    iov[1].iov_len = size2;
+    txCalls++;
+    n = ::writev(fd, iov, 2);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return 0;
+        n = 0;
+    }
+    txBytes += n;
+    // rest (if socket buffer was full) is sent with blocking write
+    if ((size_t)n < size1) {
+        n = write(buf1 + n, size1 - n) + n;
+        if ((size_t)n != size1) return n;
+        return n + write(buf2, size2);
+    }
+    if ((size_t)n < size1 + size2) {
+        return n + write(buf2 + (n - size1), size2 - (n - size1));
+    }
+    return n;
+}
+
+int PosixClient::available()
+{
+    int n;
+    char c;
+    if (fd < 0) return 0;
+    if (ioctl(fd, FIONREAD, &n) < 0) return 0;
+    if (!n && !eof && ::recv(fd, &c, 1, MSG_PEEK) == 0) eof = 1;
+    return n;
+}
+
+int PosixClient::read()
+{
+    uint8_t c;
+    if (read(&c, 1) != 1) return -1;
+    return c;
+}
+
+int PosixClient::read(uint8_t *buf, size_t size)
+{
+    ssize_t n;
+    if (fd < 0) return -1;
+    n = ::recv(fd, buf, size, 0);
+    rxCalls++;
+    if (n == 0) eof = 1;
+    if (n <= 0) return -1;
+    rxBytes += n;
+    return n;
+}
+
+int PosixClient::peek()
+{
+    uint8_t c;
+    if (fd < 0 || ::recv(fd, &c, 1, MSG_PEEK) != 1) return -1;
+    return c;
+}
+
+void PosixClient::flush()
+{
+}
+
+void PosixClient::stop()
+{
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+uint8_t PosixClient::connected()
+{
+    if (fd < 0) return 0;
+    if (!eof) available();
+    return !eof;
+}
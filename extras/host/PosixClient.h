@@ -0,0 +1,73 @@
+/*
+ * PosixClient.h - Arduino Client over POSIX TCP sockets
+ * Copyright (C) Bohdan R. Rau 2016 <ethanak@polip.com>
+ *
+ * SimplePgSQL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * SimplePgSQL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with SimplePgSQL.  If not, write to:
+ * 	The Free Software Foundation, Inc.,
+ * 	51 Franklin Street, Fifth Floor
+ * 	Boston, MA  02110-1301, USA.
+ */
+#ifndef _PG_HOST_POSIXCLIENT_H
+#define _PG_HOST_POSIXCLIENT_H 1
+
+#include "Client.h"
+
+class PosixClient : public Client {
+    public:
+        PosixClient(void);
+        virtual ~PosixClient();
+        virtual int connect(IPAddress ip, uint16_t port);
+        virtual int connect(const char *host, uint16_t port);
+        virtual size_t write(uint8_t);
+        virtual size_t write(const uint8_t *buf, size_t size);
+        virtual size_t writev(const uint8_t *buf1, size_t size1,
+                const uint8_t *buf2, size_t size2);
+        virtual int available();
+        virtual int read();
+        virtual int read(uint8_t *buf, size_t size);
+        virtual int peek();
+        virtual void flush();
+        virtual void stop();
+        virtual uint8_t connected();
+        virtual operator bool() {
+            return fd >= 0;
+        };
+        /*
+         * returns socket descriptor or -1 if not connected
+         */
+        int socket(void) {
+            return fd;
+        };
+        /*
+         * traffic statistics since object creation
+         */
+        uint64_t bytesReceived(void) {
+            return rxBytes;
+        };
+        uint64_t bytesSent(void) {
+            return txBytes;
+        };
+        uint64_t writeCalls(void) {
+            return txCalls;
+        };
+        uint64_t readCalls(void) {
+            return rxCalls;
+        };
+    private:
+        int fd;
+        int eof;
+        uint64_t rxBytes, txBytes, rxCalls, txCalls;
+};
+
+#endif
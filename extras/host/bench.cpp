@@ -0,0 +1,356 @@
+/*
+ * bench.cpp - SimplePgSQL protocol benchmark against mock backend
+ * Copyright (C) Bohdan R. Rau 2016 <ethanak@polip.com>
+ *
+ * SimplePgSQL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * SimplePgSQL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with SimplePgSQL.  If not, write to:
+ * 	The Free Software Foundation, Inc.,
+ * 	51 Franklin Street, Fifth Floor
+ * 	Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Measures client side of protocol: per-query latency of short
+ * commands and rows/s, bytes/s of result sets, using simple and
+ * extended query protocol. Mock backend runs in the same process,
+ * so results show library overhead, not network nor server speed.
+ *
+ * usage: bench [-n queries] [-r rows] [-c columns] [-w width]
+ *              [-m buffer] [-s segment] [-d usec] [-u user] [-b database]
+ */
+
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "SimplePgSQL.h"
+#include "PosixClient.h"
+#include "MockBackend.h"
+
+static int queries = 2000;
+static int rows = 10000;
+static int columns = 4;
+static int width = 16;
+static int memory = 0;
+static int segSize = 0;
+static int segDelay = 0;
+static const char *user = "user";
+static const char *dbname = "bench";
+
+static double now(void)
+{
+    return std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int waitConnection(PGconnection &conn)
+{
+    int rc;
+    double start = now();
+    while ((rc = conn.status()) != CONNECTION_OK) {
+        if (rc == CONNECTION_BAD || rc == CONNECTION_NEEDED) return -1;
+        if (now() - start > 5) return -1;
+    }
+    return 0;
+}
+
+/*
+ * fetches results until ready
+ * returns number of rows or -1 on error
+ */
+static long fetch(PGconnection &conn, long *bytes)
+{
+    long n = 0;
+    int rc, i;
+    for (;;) {
+        rc = conn.getData();
+        if (rc < 0) return -1;
+        if (rc & PG_RSTAT_HAVE_ERROR) return -1;
+        if (rc & PG_RSTAT_HAVE_ROW) {
+            n++;
+            if (bytes) for (i = 0; i < conn.nfields(); i++) {
+                *bytes += conn.getLength(i);
+            }
+        }
+        if (rc & PG_RSTAT_READY) return n;
+    }
+}
+
+static void report(const char *name, std::vector<double> &lat)
+{
+    double sum = 0;
+    size_t i;
+    std::sort(lat.begin(), lat.end());
+    for (i = 0; i < lat.size(); i++) sum += lat[i];
+    printf("%-20s %8zu queries  avg %8.2f us  p50 %8.2f us  p99 %8.2f us  max %8.2f us\n",
+            name, lat.size(), sum * 1e6 / lat.size(),
+            lat[lat.size() / 2] * 1e6, lat[lat.size() * 99 / 100] * 1e6,
+            lat.back() * 1e6);
+}
+
+static int benchLatency(PGconnection &conn)
+{
+    std::vector<double> lat;
+    const char *params[1] = {"1"};
+    double t;
+    int i;
+
+    for (i = 0; i < queries; i++) {
+        t = now();
+        if (conn.execute("DO") || fetch(conn, NULL) < 0) return -1;
+        lat.push_back(now() - t);
+    }
+    report("execute latency", lat);
+
+    lat.clear();
+    if (conn.prepare("bench", "SELECT $1") || fetch(conn, NULL) < 0) return -1;
+    for (i = 0; i < queries; i++) {
+        t = now();
+        if (conn.executePrepared("bench", 1, params) || fetch(conn, NULL) < 0) return -1;
+        lat.push_back(now() - t);
+    }
+    report("prepared latency", lat);
+    return 0;
+}
+
+static int benchRows(PGconnection &conn, PosixClient &client, int binary)
+{
+    char query[64];
+    const char *name;
+    long n, bytes = 0;
+    uint64_t wire;
+    double t;
+
+    snprintf(query, sizeof(query), "ROWS %d %d %d", rows, columns, width);
+    wire = client.bytesReceived();
+    t = now();
+    if (binary < 0) {
+        name = "execute rows";
+        if (conn.execute(query)) return -1;
+    }
+    else {
+        name = binary ? "prepared rows bin" : "prepared rows";
+        if (conn.prepare("rows", query) || fetch(conn, NULL) < 0) return -1;
+        wire = client.bytesReceived();
+        t = now();
+        if (conn.executePrepared("rows", 0, NULL, binary)) return -1;
+    }
+    if ((n = fetch(conn, &bytes)) < 0) return -1;
+    t = now() - t;
+    wire = client.bytesReceived() - wire;
+    printf("%-20s %8ld rows  %10.0f rows/s  %8.2f MB/s values  %8.2f MB/s wire\n",
+            name, n, n / t, bytes / t / 1e6, wire / t / 1e6);
+    return 0;
+}
+
+static void visitRow(void *ctx, int field, const char *data, int len, int isNull)
+{
+    (void) data;
+    (void) isNull;
+    if (field < 0) ((long *)ctx)[0]++;
+    else ((long *)ctx)[1] += len > 0 ? len : 0;
+}
+
+static int benchVisitor(PGconnection &conn, PosixClient &client)
+{
+    char query[64];
+    long counters[2] = {0, 0};
+    uint64_t wire;
+    double t;
+
+    snprintf(query, sizeof(query), "ROWS %d %d %d", rows, columns, width);
+    conn.setRowHandler(visitRow, counters);
+    wire = client.bytesReceived();
+    t = now();
+    if (conn.execute(query) || fetch(conn, NULL) < 0) return -1;
+    t = now() - t;
+    wire = client.bytesReceived() - wire;
+    conn.setRowHandler(NULL);
+    printf("%-20s %8ld rows  %10.0f rows/s  %8.2f MB/s values  %8.2f MB/s wire\n",
+            "visitor rows", counters[0], counters[0] / t, counters[1] / t / 1e6, wire / t / 1e6);
+    return 0;
+}
+
+/*
+ * whole result collected with fetchAll, then every value
+ * looked up by row and column
+ */
+static int benchFetch(PGconnection &conn, PosixClient &client)
+{
+    PGresult res(rows * columns * (width + 1 + sizeof(PGresultPos)) + 64);
+    char query[64];
+    long bytes = 0;
+    uint64_t wire;
+    double t;
+    int i, j;
+
+    snprintf(query, sizeof(query), "ROWS %d %d %d", rows, columns, width);
+    wire = client.bytesReceived();
+    t = now();
+    if (conn.fetchAll(&res) || conn.execute(query) || fetch(conn, NULL) < 0 || res.truncated()) return -1;
+    for (i = 0; i < res.nrows(); i++) {
+        for (j = 0; j < res.nfields(); j++) bytes += res.getLength(i, j);
+    }
+    t = now() - t;
+    wire = client.bytesReceived() - wire;
+    printf("%-20s %8d rows  %10.0f rows/s  %8.2f MB/s values  %8.2f MB/s wire\n",
+            "fetchAll rows", res.nrows(), res.nrows() / t, bytes / t / 1e6, wire / t / 1e6);
+    return 0;
+}
+
+/*
+ * telemetry inserts: one executeFormat round trip per sample,
+ * then samples collected by PGbatch, 100 rows per statement
+ */
+static int benchInsert(PGconnection &conn)
+{
+    PGbatch batch(&conn, "INSERT INTO samples (sensor, value) VALUES ", 2, 4096);
+    char value[16];
+    const char *values[2] = {"sensor-1", value};
+    double t;
+    int i, rc;
+
+    t = now();
+    for (i = 0; i < queries; i++) {
+        if (conn.executeFormat(PG_FORMAT("INSERT INTO samples (sensor, value) VALUES (%s, %d)"),
+                    "sensor-1", i) || fetch(conn, NULL) < 0) return -1;
+    }
+    t = now() - t;
+    printf("%-20s %8d rows  %10.0f rows/s\n", "executeFormat insert", queries, queries / t);
+
+    batch.setLimits(100);
+    t = now();
+    for (i = 0; i < queries; i++) {
+        snprintf(value, sizeof(value), "%d", i);
+        while ((rc = batch.addRow(values)) == 1) {
+            if (fetch(conn, NULL) < 0) return -1;
+        }
+        if (rc < 0) return -1;
+    }
+    // previous statement may be still running
+    while ((rc = batch.flush()) == 1) {
+        if (fetch(conn, NULL) < 0) return -1;
+    }
+    if (rc < 0) return -1;
+    if (!(conn.dataStatus() & PG_RSTAT_READY) && fetch(conn, NULL) < 0) return -1;
+    t = now() - t;
+    printf("%-20s %8d rows  %10.0f rows/s\n", "PGbatch insert", queries, queries / t);
+    return 0;
+}
+
+/*
+ * escaping of long literal, mostly plain text with rare quotes,
+ * as in logged messages
+ */
+static int benchEscape(PGconnection &conn)
+{
+    std::vector<char> in(64 * 1024), out(2 * in.size() + 4);
+    double t;
+    long bytes = 0;
+    int i, n = 0;
+
+    for (i = 0; i < (int)in.size() - 1; i++) {
+        in[i] = (i % 97 == 96) ? '\'' : 'a' + i % 26;
+    }
+    in[i] = 0;
+    t = now();
+    for (i = 0; i < queries; i++) {
+        n = conn.escapeString(in.data(), NULL);
+        if (conn.escapeString(in.data(), out.data()) != n) return -1;
+        bytes += in.size() - 1;
+    }
+    t = now() - t;
+    printf("%-20s %8d calls    %8.2f MB/s\n", "escapeString", queries, bytes / t / 1e6);
+    return 0;
+}
+
+/*
+ * connection setup with md5 authorization
+ */
+static int benchConnect(int port)
+{
+    PosixClient client;
+    PGconnection conn(&client, 0, memory);
+    std::vector<double> lat;
+    double t;
+    int i, n = queries / 10 + 1;
+
+    for (i = 0; i < n; i++) {
+        t = now();
+        conn.setDbLogin(IPAddress(127, 0, 0, 1), user, "secret", dbname, "utf8", port);
+        if (waitConnection(conn)) return -1;
+        lat.push_back(now() - t);
+        conn.close();
+    }
+    report("connect", lat);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:c:w:m:s:d:u:b:")) != -1) {
+        switch (opt) {
+            case 'n': queries = atoi(optarg); break;
+            case 'r': rows = atoi(optarg); break;
+            case 'c': columns = atoi(optarg); break;
+            case 'w': width = atoi(optarg); break;
+            case 'm': memory = atoi(optarg); break;
+            case 's': segSize = atoi(optarg); break;
+            case 'd': segDelay = atoi(optarg); break;
+            case 'u': user = optarg; break;
+            case 'b': dbname = optarg; break;
+            default:
+            fprintf(stderr, "usage: %s [-n queries] [-r rows] [-c columns] [-w width]\n"
+                    "        [-m buffer] [-s segment] [-d usec] [-u user] [-b database]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (queries < 1) queries = 1;
+
+    MockBackend backend(user);
+    int port = backend.start();
+    if (port < 0) {
+        fprintf(stderr, "cannot start mock backend\n");
+        return 1;
+    }
+    backend.setSegments(segSize, segDelay);
+
+    PosixClient client;
+    PGconnection conn(&client, 0, memory);
+    conn.setDbLogin(IPAddress(127, 0, 0, 1), user, "secret", dbname, "utf8", port);
+    if (waitConnection(conn)) {
+        fprintf(stderr, "connection failed: %s\n", conn.getMessage());
+        return 1;
+    }
+    printf("buffer %d, receive window %d, %d rows x %d columns x %d bytes\n",
+            memory > 0 ? memory : PG_BUFFER_SIZE, PG_RECV_SIZE, rows, columns, width);
+    if (benchLatency(conn) ||
+            benchRows(conn, client, -1) ||
+            benchRows(conn, client, 0) ||
+            benchRows(conn, client, 1) ||
+            benchVisitor(conn, client) ||
+            benchFetch(conn, client) ||
+            benchInsert(conn) ||
+            benchEscape(conn) ||
+            benchConnect(port)) {
+        fprintf(stderr, "benchmark failed: %s\n", conn.getMessage());
+        return 1;
+    }
+    printf("client: %llu read calls, %llu write calls\n",
+            (unsigned long long)client.readCalls(),
+            (unsigned long long)client.writeCalls());
+    conn.close();
+    backend.stop();
+    return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * coro.cpp - coroutine sessions demo against mock backend
+ * Copyright (C) Bohdan R. Rau 2016 <ethanak@polip.com>
+ *
+ * SimplePgSQL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * SimplePgSQL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with SimplePgSQL.  If not, write to:
+ * 	The Free Software Foundation, Inc.,
+ * 	51 Franklin Street, Fifth Floor
+ * 	Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Every task logs in, then sends given number of commands and
+ * selects, iterating rows with co_await; every tenth task runs
+ * failing query too and abandons one result set halfway.
+ * All sessions run in single thread.
+ *
+ * usage: coro [-p tasks] [-q queries] [-r rows] [-m buffer]
+ *             [-s segment] [-d usec]
+ */
+
+#include <unistd.h>
+#include <chrono>
+#include "Coroutines.h"
+#include "MockBackend.h"
+
+static int tasks = 200;
+static int queries = 50;
+static int rows = 10;
+static int memory = 0;
+static int segSize = 0;
+static int segDelay = 0;
+
+static int done, failed;
+static long total;
+
+static double now(void)
+{
+    return std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static CoTask worker(CoScheduler &sched, const PGprofile *profile, int id)
+{
+    CoSession s(sched, 0, memory);
+    char query[64];
+    int i;
+
+    snprintf(query, sizeof(query), "ROWS %d 4 16", rows);
+    if (co_await s.connect(profile) != CONNECTION_OK) {
+        fprintf(stderr, "task %d: %s\n", id, s.error());
+        failed++;
+        co_return;
+    }
+    if (id % 10 == 0) {
+        if (co_await s.query("ERROR") == 0) {
+            fprintf(stderr, "task %d: error expected\n", id);
+            failed++;
+            co_return;
+        }
+        CoRows half = s.rows(query);
+        for (i = 0; i < rows / 2 && co_await half.next(); i++);
+    }
+    for (i = 0; i < queries; i++) {
+        if (i & 1) {
+            CoRows r = s.rows(query);
+            while (co_await r.next()) {
+                if (!r.value(0)) break;
+                total++;
+            }
+            if (r.failed()) break;
+        }
+        else if (co_await s.query("DO")) break;
+    }
+    if (i < queries) {
+        fprintf(stderr, "task %d: %s\n", id, s.error());
+        failed++;
+        co_return;
+    }
+    done++;
+}
+
+int main(int argc, char **argv)
+{
+    int opt, i;
+    double t;
+
+    while ((opt = getopt(argc, argv, "p:q:r:m:s:d:")) != -1) {
+        switch (opt) {
+            case 'p': tasks = atoi(optarg); break;
+            case 'q': queries = atoi(optarg); break;
+            case 'r': rows = atoi(optarg); break;
+            case 'm': memory = atoi(optarg); break;
+            case 's': segSize = atoi(optarg); break;
+            case 'd': segDelay = atoi(optarg); break;
+            default:
+            fprintf(stderr, "usage: %s [-p tasks] [-q queries] [-r rows] [-m buffer]\n"
+                    "        [-s segment] [-d usec]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    MockBackend backend;
+    int port = backend.start();
+    if (port < 0) {
+        fprintf(stderr, "cannot start mock backend\n");
+        return 1;
+    }
+    backend.setSegments(segSize, segDelay);
+
+    PGprofile profile;
+    if (profile.set(IPAddress(127, 0, 0, 1), "user", "secret", "bench", "utf8", port)) {
+        fprintf(stderr, "cannot create profile\n");
+        return 1;
+    }
+    CoScheduler sched;
+    for (i = 0; i < tasks; i++) sched.spawn(worker(sched, &profile, i));
+    t = now();
+    if (sched.run()) fprintf(stderr, "scheduler failed\n");
+    t = now() - t;
+    printf("%d tasks, %d finished, %d failed, %ld rows, %.0f queries/s\n",
+            tasks, done, failed, total, (double)done * queries / t);
+    backend.stop();
+    return failed || done != tasks;
+}
@@ -0,0 +1,172 @@
+/*
+ * multiplex.cpp - many connections on one thread with EpollDriver
+ * Copyright (C) Bohdan R. Rau 2016 <ethanak@polip.com>
+ *
+ * SimplePgSQL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * SimplePgSQL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with SimplePgSQL.  If not, write to:
+ * 	The Free Software Foundation, Inc.,
+ * 	51 Franklin Street, Fifth Floor
+ * 	Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Every connection logs in and executes given number of queries,
+ * each next one sent from handler when previous is finished.
+ * Reports throughput, CPU time used by client thread and number
+ * of decoder calls per query; calls without progress show wakeups,
+ * busy waiting would make their number large.
+ *
+ * usage: multiplex [-p connections] [-q queries] [-r rows] [-m buffer]
+ *                  [-s segment] [-d usec]
+ */
+
+#include <unistd.h>
+#include <sys/resource.h>
+#include <chrono>
+#include <vector>
+#include "EpollDriver.h"
+#include "MockBackend.h"
+
+static int conns = 200;
+static int queries = 50;
+static int rows = 10;
+static int memory = 0;
+static int segSize = 0;
+static int segDelay = 0;
+
+struct Session {
+    PosixClient client;
+    PGconnection *conn;
+    int left;
+    long rows;
+    bool failed;
+};
+
+static int active;
+static char query[64];
+
+static double now(void)
+{
+    return std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double cpu(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_THREAD, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+        (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void finish(Session *s, bool failed)
+{
+    s->failed = failed;
+    s->left = 0;
+    active--;
+}
+
+static void handler(void *ctx, PGconnection *conn, int rc)
+{
+    Session *s = (Session *)ctx;
+    if (rc < 0 || (!rc && conn->status() != CONNECTION_OK)) {
+        finish(s, true);
+        return;
+    }
+    if (rc & PG_RSTAT_HAVE_ERROR) {
+        finish(s, true);
+        return;
+    }
+    if (rc & PG_RSTAT_HAVE_ROW) s->rows++;
+    if (!rc || (rc & PG_RSTAT_READY)) {
+        if (!s->left) {
+            finish(s, false);
+            return;
+        }
+        s->left--;
+        if (conn->execute(query)) finish(s, true);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int opt, i, failed = 0;
+    long total = 0;
+    double t, c;
+
+    while ((opt = getopt(argc, argv, "p:q:r:m:s:d:")) != -1) {
+        switch (opt) {
+            case 'p': conns = atoi(optarg); break;
+            case 'q': queries = atoi(optarg); break;
+            case 'r': rows = atoi(optarg); break;
+            case 'm': memory = atoi(optarg); break;
+            case 's': segSize = atoi(optarg); break;
+            case 'd': segDelay = atoi(optarg); break;
+            default:
+            fprintf(stderr, "usage: %s [-p connections] [-q queries] [-r rows] [-m buffer]\n"
+                    "        [-s segment] [-d usec]\n", argv[0]);
+            return 1;
+        }
+    }
+    snprintf(query, sizeof(query), "ROWS %d 2 8", rows);
+
+    MockBackend backend;
+    int port = backend.start();
+    if (port < 0) {
+        fprintf(stderr, "cannot start mock backend\n");
+        return 1;
+    }
+    backend.setSegments(segSize, segDelay);
+    PGprofile profile;
+    profile.set(IPAddress(127, 0, 0, 1), "user", "secret", "bench", NULL, port);
+
+    EpollDriver driver;
+    std::vector<Session *> sessions;
+    t = now();
+    c = cpu();
+    for (i = 0; i < conns; i++) {
+        Session *s = new Session;
+        s->conn = new PGconnection(&s->client, 0, memory);
+        s->left = queries;
+        s->rows = 0;
+        s->failed = false;
+        sessions.push_back(s);
+        active++;
+        s->conn->setDbLogin(&profile);
+        if (driver.add(s->conn, &s->client, handler, s)) finish(s, true);
+    }
+    while (active > 0) {
+        if (driver.run(5000) <= 0) {
+            fprintf(stderr, "timeout, %d connections active\n", active);
+            return 1;
+        }
+    }
+    t = now() - t;
+    c = cpu() - c;
+    for (i = 0; i < conns; i++) {
+        total += sessions[i]->rows;
+        if (sessions[i]->failed) failed++;
+        driver.remove(sessions[i]->conn);
+        sessions[i]->conn->close();
+        delete sessions[i]->conn;
+        delete sessions[i];
+    }
+    printf("%d connections, %d failed, %d queries, %ld rows\n",
+            conns, failed, conns * queries, total);
+    printf("%.3f s, %.0f queries/s, client CPU %.3f s\n", t, conns * queries / t, c);
+    printf("per query: %.2f decoder calls, %.2f of them without progress\n",
+            (double)driver.calls() / (conns * (queries + 1)),
+            (double)driver.idleCalls() / (conns * (queries + 1)));
+    backend.stop();
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,190 @@
+/*
+ * rowqueue.cpp - PGrowQueue cross-thread demo against mock backend
+ * Copyright (C) Bohdan R. Rau 2016 <ethanak@polip.com>
+ *
+ * SimplePgSQL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * SimplePgSQL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with SimplePgSQL.  If not, write to:
+ * 	The Free Software Foundation, Inc.,
+ * 	51 Franklin Street, Fifth Floor
+ * 	Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Network thread executes queries and lets connection put rows
+ * into PGrowQueue, main thread consumes and checks them while
+ * next rows are received. Every result ends with end mark
+ * holding number of rows, -1 marks end of work.
+ *
+ * usage: rowqueue [-q queries] [-r rows] [-c columns] [-w width]
+ *                 [-k queue kB] [-n] [-m buffer] [-s segment] [-d usec]
+ */
+
+#include <unistd.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "SimplePgSQL.h"
+#include "PosixClient.h"
+#include "MockBackend.h"
+
+static int queries = 20;
+static int rows = 10000;
+static int columns = 4;
+static int width = 16;
+static int queueSize = 16;
+static int nulls = 0;
+static int memory = 0;
+static int segSize = 0;
+static int segDelay = 0;
+
+static double now(void)
+{
+    return std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void putEnd(PGrowQueue &queue, int32_t value)
+{
+    while (!queue.putEnd(value)) std::this_thread::yield();
+}
+
+/*
+ * producer thread
+ */
+static void network(PGconnection *conn, PosixClient *client, PGrowQueue *queue,
+        const char *query, int *failed)
+{
+    uint64_t received;
+    int i, rc, left;
+
+    for (i = 0; i < queries; i++) {
+        if (conn->execute(query)) break;
+        do {
+            received = client->bytesReceived();
+            left = conn->buffered();
+            rc = conn->getData();
+            // queue is full or no data arrived
+            if (!rc && received == client->bytesReceived() && left == conn->buffered()) {
+                std::this_thread::yield();
+            }
+        } while (rc >= 0 && !(rc & (PG_RSTAT_READY | PG_RSTAT_HAVE_ERROR)));
+        if (rc < 0 || (rc & PG_RSTAT_HAVE_ERROR)) break;
+        putEnd(*queue, conn->ntuples());
+    }
+    if (i < queries) *failed = 1;
+    putEnd(*queue, -1);
+}
+
+/*
+ * returns 0 if row n has expected values
+ */
+static int checkRow(PGrowQueue &queue, long n)
+{
+    char *c, *e;
+    int i;
+
+    if (queue.nfields() != columns) return -1;
+    for (i = 0; i < columns; i++) {
+        c = queue.getValue(i);
+        if (nulls && (n + i) % 3 == 0) {
+            if (c || queue.getLength(i) != -1) return -1;
+            continue;
+        }
+        if (!c || queue.getLength(i) != width || (int)strlen(c) != width) return -1;
+        // values start with "row:column" if wide enough
+        if (width < 8) continue;
+        if (strtol(c, &e, 10) != n || *e != ':' || strtol(e + 1, NULL, 10) != i) return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char query[80];
+    long n = 0, total = 0, spins = 0;
+    int opt, rc, results = 0, failed = 0, bad = 0;
+    double t;
+
+    while ((opt = getopt(argc, argv, "q:r:c:w:k:nm:s:d:")) != -1) {
+        switch (opt) {
+            case 'q': queries = atoi(optarg); break;
+            case 'r': rows = atoi(optarg); break;
+            case 'c': columns = atoi(optarg); break;
+            case 'w': width = atoi(optarg); break;
+            case 'k': queueSize = atoi(optarg); break;
+            case 'n': nulls = 1; break;
+            case 'm': memory = atoi(optarg); break;
+            case 's': segSize = atoi(optarg); break;
+            case 'd': segDelay = atoi(optarg); break;
+            default:
+            fprintf(stderr, "usage: %s [-q queries] [-r rows] [-c columns] [-w width]\n"
+                    "        [-k queue kB] [-n] [-m buffer] [-s segment] [-d usec]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    MockBackend backend;
+    int port = backend.start();
+    if (port < 0) {
+        fprintf(stderr, "cannot start mock backend\n");
+        return 1;
+    }
+    backend.setSegments(segSize, segDelay);
+
+    PosixClient client;
+    PGconnection conn(&client, 0, memory);
+    conn.setDbLogin(IPAddress(127, 0, 0, 1), "user", "secret", "bench", "utf8", port);
+    while ((rc = conn.status()) != CONNECTION_OK) {
+        if (rc == CONNECTION_BAD || rc == CONNECTION_NEEDED) {
+            fprintf(stderr, "connection failed: %s\n", conn.getMessage());
+            return 1;
+        }
+    }
+
+    std::vector<char> memory(queueSize * 1024);
+    PGrowQueue queue(memory.data(), memory.size());
+    conn.setRowQueue(&queue);
+    snprintf(query, sizeof(query), "ROWS %d %d %d%s", rows, columns, width,
+            nulls ? " nulls" : "");
+
+    t = now();
+    std::thread producer(network, &conn, &client, &queue, query, &failed);
+    for (;;) {
+        rc = queue.peek();
+        if (!rc) {
+            spins++;
+            std::this_thread::yield();
+            continue;
+        }
+        if (rc == 2) {
+            if (queue.endValue() < 0) break;
+            if (queue.endValue() != n) bad++;
+            results++;
+            n = 0;
+        }
+        else {
+            if (checkRow(queue, n)) bad++;
+            n++;
+            total++;
+        }
+        queue.pop();
+    }
+    producer.join();
+    t = now() - t;
+    printf("%d results, %ld rows, %.0f rows/s, %ld empty polls, %d bad\n",
+            results, total, total / t, spins, bad);
+    if (failed) fprintf(stderr, "query failed: %s\n", conn.getMessage());
+    conn.close();
+    backend.stop();
+    return failed || bad || results != queries;
+}